@@ -4,153 +4,2920 @@
  */
 
 #include <alsa/asoundlib.h>
+#include <alsa/control_external.h>
 #include <alsa/pcm.h>
 #include <alsa/pcm_external.h>
 #include <alsa/pcm_ioplug.h>
+#include <flowgraph/resampler/MultiChannelResampler.h>
 #include <oboe/Oboe.h>
+#include <fcntl.h>
+#include <sys/auxv.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include "pcm_oboe.h"
+#include "pcm_oboe_trace.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <initializer_list>
+#include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <numeric>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * @return The current time of CLOCK_MONOTONIC in nanoseconds.
+ */
+static int64_t GetMonotonicNanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * oboe::kNanosPerSecond + now.tv_nsec;
+}
+
+static const int64_t LoadTimestamp{GetMonotonicNanoseconds()}; //!< The time at which the library was loaded, this is used to measure how long it takes for a PCM to become ready.
+
+/**
+ * @brief A snapshot of the playback position that is published by the data callback and can be read from any thread without locking.
+ * @note This is a seqlock with a single writer, readers retry if they observe a write in progress or the sequence changing under them.
+ */
+class StatusPage {
+  private:
+    std::atomic<uint32_t> sequence{};
+    std::atomic<uint64_t> hwPosition{};
+    std::atomic<int64_t> deviceDelay{};
+    std::atomic<int64_t> timestamp{};
+
+  public:
+    struct Status {
+        uint64_t hwPosition; //!< The total amount of frames consumed from the ring.
+        int64_t deviceDelay; //!< The amount of frames that were handed to Oboe but not yet presented at the time of the snapshot.
+        int64_t timestamp; //!< The CLOCK_MONOTONIC time of the snapshot in nanoseconds, this is 0 if the stream hasn't produced a snapshot yet.
+    };
+
+    /**
+     * @note This must only be called by a single writer at a time.
+     */
+    void Publish(const Status& status) {
+        uint32_t seq{sequence.load(std::memory_order_relaxed)};
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        hwPosition.store(status.hwPosition, std::memory_order_relaxed);
+        deviceDelay.store(status.deviceDelay, std::memory_order_relaxed);
+        timestamp.store(status.timestamp, std::memory_order_relaxed);
+
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    Status Read() const {
+        Status status;
+        uint32_t begin, end;
+        do {
+            begin = sequence.load(std::memory_order_acquire);
+            status.hwPosition = hwPosition.load(std::memory_order_relaxed);
+            status.deviceDelay = deviceDelay.load(std::memory_order_relaxed);
+            status.timestamp = timestamp.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            end = sequence.load(std::memory_order_relaxed);
+        } while (begin != end || (begin & 1));
+        return status;
+    }
+};
+
+/**
+ * @brief A wait-free queue of a fixed capacity with a single producer and a single consumer.
+ */
+template <typename Type, size_t Capacity>
+class SpscQueue {
+  private:
+    std::array<Type, Capacity> items{};
+    alignas(64) std::atomic<size_t> head{}; //!< The index of the next item that will be popped, this is only written by the consumer.
+    alignas(64) std::atomic<size_t> tail{}; //!< The index of the next item that will be pushed, this is only written by the producer.
+
+  public:
+    /**
+     * @return If the item could be pushed, this fails if the queue is full.
+     */
+    bool Push(const Type& item) {
+        size_t index{tail.load(std::memory_order_relaxed)};
+        if (index - head.load(std::memory_order_acquire) == Capacity)
+            return false;
+
+        items[index % Capacity] = item;
+        tail.store(index + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @return If an item was popped, this fails if the queue is empty.
+     */
+    bool Pop(Type& item) {
+        size_t index{head.load(std::memory_order_relaxed)};
+        if (index == tail.load(std::memory_order_acquire))
+            return false;
+
+        item = items[index % Capacity];
+        head.store(index + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+/**
+ * @brief A spinlock that the data callback holds while it renders, other threads acquire it to access the state of the callback rather than waiting on the stream.
+ * @note The data callback only ever tries to acquire it and renders silence if it can't, while other threads only hold it for short computations.
+ *       Spinning on it is therefore bounded by the duration of a single callback without ever depending on the device.
+ */
+class RenderLock {
+  private:
+    std::atomic<bool> locked{};
+
+  public:
+    bool try_lock() {
+        return !locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void lock() {
+        while (!try_lock())
+            std::this_thread::yield();
+    }
+
+    void unlock() {
+        locked.store(false, std::memory_order_release);
+    }
+};
+
+/**
+ * @return The ALSA channel positions of the standard layout for the supplied channel count, these follow the default ALSA channel order.
+ */
+static std::vector<unsigned int> GetChannelPositions(unsigned int channels) {
+    switch (channels) {
+        case 1:
+            return {SND_CHMAP_MONO};
+        case 2:
+            return {SND_CHMAP_FL, SND_CHMAP_FR};
+        case 4:
+            return {SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL, SND_CHMAP_RR};
+        case 6:
+            return {SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL, SND_CHMAP_RR, SND_CHMAP_FC, SND_CHMAP_LFE};
+        case 8:
+            return {SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL, SND_CHMAP_RR, SND_CHMAP_FC, SND_CHMAP_LFE, SND_CHMAP_SL, SND_CHMAP_SR};
+        default:
+            return {};
+    }
+}
+
+/**
+ * @brief Per-channel peak and RMS levels of the audio passing through a PCM, these are measured over consecutive windows by the data callback.
+ * @note The accumulators are only touched by the data callback, the levels of the last complete window are published atomically for any reader.
+ */
+class LevelMeter {
+  public:
+    constexpr static unsigned int MaxChannels{8};
+
+    /**
+     * @brief The running levels of the current window, these are updated directly by the transfer kernels.
+     */
+    struct Accumulator {
+        float peak[MaxChannels];
+        float sumSquares[MaxChannels];
+    };
+
+  private:
+    unsigned int channels{};
+    size_t windowFrames{};
+    size_t accumulatedFrames{};
+    Accumulator accumulator{};
+    std::atomic<float> publishedPeak[MaxChannels]{};
+    std::atomic<float> publishedRms[MaxChannels]{};
+
+  public:
+    /**
+     * @note This must not be called while the data callback could be running.
+     */
+    void Reset(unsigned int channelCount, size_t window) {
+        channels = std::min(channelCount, MaxChannels);
+        windowFrames = window;
+        accumulatedFrames = 0;
+        for (unsigned int c{}; c < MaxChannels; c++) {
+            accumulator.peak[c] = accumulator.sumSquares[c] = 0.0f;
+            publishedPeak[c].store(0.0f, std::memory_order_relaxed);
+            publishedRms[c].store(0.0f, std::memory_order_relaxed);
+        }
+    }
+
+    Accumulator& GetAccumulator() {
+        return accumulator;
+    }
+
+    /**
+     * @brief Accounts for frames that have been accumulated, the levels are published once a window has been completed.
+     */
+    void Commit(size_t frames) {
+        accumulatedFrames += frames;
+        if (accumulatedFrames < windowFrames)
+            return;
+
+        for (unsigned int c{}; c < channels; c++) {
+            publishedPeak[c].store(accumulator.peak[c], std::memory_order_relaxed);
+            publishedRms[c].store(std::sqrt(accumulator.sumSquares[c] / static_cast<float>(accumulatedFrames)), std::memory_order_relaxed);
+            accumulator.peak[c] = accumulator.sumSquares[c] = 0.0f;
+        }
+        accumulatedFrames = 0;
+    }
+
+    unsigned int GetChannels() const {
+        return channels;
+    }
+
+    float GetPeak(unsigned int channel) const {
+        return publishedPeak[channel].load(std::memory_order_relaxed);
+    }
+
+    float GetRms(unsigned int channel) const {
+        return publishedRms[channel].load(std::memory_order_relaxed);
+    }
+};
+
+/**
+ * @brief A matrix mixer for converting audio between the standard channel layouts.
+ * @note Downmixing uses the ITU-R BS.775 coefficients, where the centre and surround channels are attenuated by 3dB into the front channels and LFE is dropped.
+ *       Every output channel is normalized so that its coefficients sum to at most 1, so the downmix of a full-scale input doesn't clip.
+ *       Upmixing never synthesizes content for channels that aren't present in the source, except for mono which is duplicated into the front channels.
+ */
+class ChannelMixer {
+  private:
+    unsigned int inputChannels;
+    unsigned int outputChannels;
+    std::vector<float> matrix; //!< The coefficient of every input channel for every output channel, laid out as [output][input].
+
+    constexpr static float MinusThreeDecibels{0.70710678f};
+
+  public:
+    ChannelMixer(unsigned int inputChannels, unsigned int outputChannels) : inputChannels{inputChannels}, outputChannels{outputChannels}, matrix(inputChannels * outputChannels) {
+        std::vector<unsigned int> inputPositions{GetChannelPositions(inputChannels)}, outputPositions{GetChannelPositions(outputChannels)};
+        auto find{[&](unsigned int position) -> int {
+            auto it{std::find(outputPositions.begin(), outputPositions.end(), position)};
+            return it != outputPositions.end() ? static_cast<int>(it - outputPositions.begin()) : -1;
+        }};
+
+        if (outputChannels == 1) {
+            // A mono output is the average of the stereo downmix, so we build that first and fold it.
+            ChannelMixer stereo{inputChannels, 2};
+            for (unsigned int i{}; i < inputChannels; i++)
+                matrix[i] = (stereo.matrix[i] + stereo.matrix[inputChannels + i]) * 0.5f;
+            return;
+        }
+
+        for (unsigned int i{}; i < inputChannels; i++) {
+            auto add{[&](unsigned int position, float gain) {
+                int output{find(position)};
+                if (output < 0)
+                    return false;
+                matrix[output * inputChannels + i] += gain;
+                return true;
+            }};
+
+            unsigned int position{inputPositions[i]};
+            if (add(position, 1.0f))
+                continue;
+
+            switch (position) {
+                case SND_CHMAP_MONO:
+                    add(SND_CHMAP_FL, 1.0f);
+                    add(SND_CHMAP_FR, 1.0f);
+                    break;
+
+                case SND_CHMAP_FC:
+                    add(SND_CHMAP_FL, MinusThreeDecibels);
+                    add(SND_CHMAP_FR, MinusThreeDecibels);
+                    break;
+
+                case SND_CHMAP_RL:
+                case SND_CHMAP_SL:
+                    if (!add(position == SND_CHMAP_RL ? SND_CHMAP_SL : SND_CHMAP_RL, 1.0f))
+                        add(SND_CHMAP_FL, MinusThreeDecibels);
+                    break;
+
+                case SND_CHMAP_RR:
+                case SND_CHMAP_SR:
+                    if (!add(position == SND_CHMAP_RR ? SND_CHMAP_SR : SND_CHMAP_RR, 1.0f))
+                        add(SND_CHMAP_FR, MinusThreeDecibels);
+                    break;
+
+                default:
+                    break; // LFE is dropped when the output has no LFE channel.
+            }
+        }
+
+        // Several input channels can be folded into one output channel, its coefficients are scaled down so that a full-scale input can't clip it.
+        for (unsigned int o{}; o < outputChannels; o++) {
+            float* row{&matrix[o * inputChannels]};
+            float sum{std::accumulate(row, row + inputChannels, 0.0f)};
+            if (sum > 1.0f)
+                std::transform(row, row + inputChannels, row, [sum](float coefficient) { return coefficient / sum; });
+        }
+    }
+
+    /**
+     * @return The coefficient of every input channel for every output channel, laid out as [output][input].
+     */
+    const float* GetMatrix() const {
+        return matrix.data();
+    }
+};
+
+/**
+ * @brief Records audio into a WAV file for debugging, the audio path only copies into a lock-free ring while a background thread writes it out.
+ * @note The sizes in the header are updated every time the ring is written out, so the file stays readable if the process is killed during a repro.
+ */
+class WavTap {
+  private:
+    FILE* file;
+    std::unique_ptr<uint8_t[]> ring;
+    size_t capacity; //!< The size of the ring in bytes.
+    alignas(64) std::atomic<uint64_t> writePosition{}; //!< The total amount of bytes written into the ring, this is only written by the producer.
+    alignas(64) std::atomic<uint64_t> readPosition{}; //!< The total amount of bytes written out of the ring, this is only written by the writer thread.
+    std::atomic<uint64_t> droppedBytes{}; //!< The amount of bytes that were dropped as the writer thread couldn't keep up.
+    uint64_t dataBytes{}; //!< The amount of bytes in the data chunk of the file, this is only accessed by the writer thread.
+    snd_pcm_format_t format;
+    unsigned int channels;
+    unsigned int rate;
+
+    std::mutex mutex; //!< Protects stopping, this is never locked by the audio path.
+    std::condition_variable condition;
+    bool stopping{};
+    std::thread writer;
+    constexpr static int64_t WriteIntervalMilliseconds{50}; //!< The interval at which the writer thread writes out the ring.
+
+    WavTap(FILE* file, snd_pcm_format_t format, unsigned int channels, unsigned int rate) : file{file}, format{format}, channels{channels}, rate{rate} {
+        // The ring holds a second of audio, the writer thread only has to keep up on average.
+        capacity = std::max<size_t>(static_cast<size_t>(snd_pcm_format_physical_width(format) / 8) * channels * rate, 64 * 1024);
+        ring = std::make_unique<uint8_t[]>(capacity);
+        WriteHeader();
+        writer = std::thread{[this] { WriterLoop(); }};
+    }
+
+    void WriteHeader() {
+        auto put32{[this](uint32_t value) { std::fwrite(&value, sizeof(value), 1, file); }};
+        auto put16{[this](uint16_t value) { std::fwrite(&value, sizeof(value), 1, file); }};
+        auto bitsPerSample{static_cast<uint16_t>(snd_pcm_format_physical_width(format))};
+
+        std::fwrite("RIFF", 4, 1, file);
+        put32(36);
+        std::fwrite("WAVEfmt ", 8, 1, file);
+        put32(16);
+        put16(format == SND_PCM_FORMAT_FLOAT_LE ? 3 : 1); // WAVE_FORMAT_IEEE_FLOAT or WAVE_FORMAT_PCM.
+        put16(static_cast<uint16_t>(channels));
+        put32(rate);
+        put32(rate * channels * bitsPerSample / 8);
+        put16(static_cast<uint16_t>(channels * bitsPerSample / 8));
+        put16(bitsPerSample);
+        std::fwrite("data", 4, 1, file);
+        put32(0);
+    }
+
+    /**
+     * @brief Writes out everything in the ring and updates the sizes in the header to match, this is only called by the writer thread.
+     */
+    void WriteOut() {
+        uint64_t read{readPosition.load(std::memory_order_relaxed)}, write{writePosition.load(std::memory_order_acquire)};
+        if (read == write)
+            return;
+
+        size_t bytes{static_cast<size_t>(write - read)}, offset{read % capacity}, firstBytes{std::min(bytes, capacity - offset)};
+        std::fwrite(ring.get() + offset, 1, firstBytes, file);
+        std::fwrite(ring.get(), 1, bytes - firstBytes, file);
+        readPosition.store(write, std::memory_order_release);
+
+        // WAV files are limited to 4GiB, anything beyond that is still written but the sizes stop being updated.
+        dataBytes += bytes;
+        if (dataBytes <= UINT32_MAX - 36) {
+            auto dataSize{static_cast<uint32_t>(dataBytes)}, riffSize{dataSize + 36};
+            std::fseek(file, 4, SEEK_SET);
+            std::fwrite(&riffSize, sizeof(riffSize), 1, file);
+            std::fseek(file, 40, SEEK_SET);
+            std::fwrite(&dataSize, sizeof(dataSize), 1, file);
+            std::fseek(file, 0, SEEK_END);
+        }
+        std::fflush(file);
+    }
+
+    void WriterLoop() {
+        std::unique_lock lock{mutex};
+        while (!stopping) {
+            condition.wait_for(lock, std::chrono::milliseconds{WriteIntervalMilliseconds});
+            lock.unlock();
+            WriteOut();
+            lock.lock();
+        }
+    }
+
+  public:
+    /**
+     * @return A tap writing into a new file at the supplied path, or null if the file couldn't be created.
+     */
+    static std::unique_ptr<WavTap> Create(const std::string& path, snd_pcm_format_t format, unsigned int channels, unsigned int rate) {
+        FILE* file{std::fopen(path.c_str(), "wbe")};
+        if (!file) {
+            std::cerr << "[ALSA Oboe] Failed to create tap " << path << ": " << std::strerror(errno) << std::endl;
+            return nullptr;
+        }
+        return std::unique_ptr<WavTap>{new WavTap{file, format, channels, rate}};
+    }
+
+    /**
+     * @return If the tap records audio with the supplied configuration.
+     */
+    bool Matches(snd_pcm_format_t format, unsigned int channels, unsigned int rate) const {
+        return this->format == format && this->channels == channels && this->rate == rate;
+    }
+
+    /**
+     * @brief Copies whole frames into the ring, they're dropped if it doesn't have enough space. This must only be called by a single producer at a time.
+     */
+    void Write(const uint8_t* data, size_t bytes) {
+        uint64_t write{writePosition.load(std::memory_order_relaxed)};
+        if (capacity - (write - readPosition.load(std::memory_order_acquire)) < bytes) {
+            droppedBytes.fetch_add(bytes, std::memory_order_relaxed);
+            return;
+        }
+
+        size_t offset{write % capacity}, firstBytes{std::min(bytes, capacity - offset)};
+        std::memcpy(ring.get() + offset, data, firstBytes);
+        std::memcpy(ring.get(), data + firstBytes, bytes - firstBytes);
+        writePosition.store(write + bytes, std::memory_order_release);
+    }
+
+    uint64_t GetDroppedBytes() const {
+        return droppedBytes.load(std::memory_order_relaxed);
+    }
+
+    ~WavTap() {
+        {
+            std::scoped_lock lock{mutex};
+            stopping = true;
+        }
+        condition.notify_all();
+        writer.join();
+        WriteOut(); // Anything that was written after the final iteration of the writer thread.
+        std::fclose(file);
+    }
+};
+
+/**
+ * @brief Records every ioplug callback of a PCM into a file so that it can be replayed with tools/oboe_replay, see pcm_oboe_trace.h for the format.
+ * @note Records are buffered by stdio, so tracing a PCM only costs a copy per callback on the calling thread. It never touches the data callback.
+ */
+class TraceRecorder {
+  private:
+    std::mutex mutex; //!< Serializes records from the threads of the application, some callbacks are called without the mutex of the PCM held.
+    FILE* file;
+    int64_t origin; //!< The time that all timestamps in the trace are relative to.
+
+    TraceRecorder(FILE* file, int64_t origin) : file{file}, origin{origin} {}
+
+  public:
+    /**
+     * @return A recorder writing into a new file at the supplied path, or null if the file couldn't be created.
+     * @param origin The time at which the PCM was opened.
+     */
+    static std::unique_ptr<TraceRecorder> Create(const std::string& path, snd_pcm_stream_t stream, int mode, int64_t origin) {
+        FILE* file{std::fopen(path.c_str(), "wbe")};
+        if (!file) {
+            std::cerr << "[ALSA Oboe] Failed to create trace " << path << ": " << std::strerror(errno) << std::endl;
+            return nullptr;
+        }
+
+        trace::TraceHeader header{.version = trace::Version, .stream = static_cast<uint32_t>(stream), .mode = static_cast<uint32_t>(mode)};
+        std::memcpy(header.magic, trace::Magic, sizeof(header.magic));
+        std::fwrite(&header, sizeof(header), 1, file);
+        return std::unique_ptr<TraceRecorder>{new TraceRecorder{file, origin}};
+    }
+
+    /**
+     * @param start The time at which the callback was entered.
+     */
+    void Record(trace::Event event, int64_t start, int64_t result, const std::array<uint64_t, 2>& arguments) {
+        int64_t duration{(GetMonotonicNanoseconds() - start) / 1000};
+        trace::TraceRecord record{
+            .timestamp = start - origin,
+            .duration = static_cast<uint32_t>(std::min<int64_t>(duration, UINT32_MAX)),
+            .event = event,
+            .result = result,
+            .arguments = {arguments[0], arguments[1]},
+        };
+
+        std::scoped_lock lock{mutex};
+        std::fwrite(&record, sizeof(record), 1, file);
+    }
+
+    ~TraceRecorder() {
+        std::fclose(file);
+    }
+};
+
+/**
+ * @brief A process-wide record of what the device granted to the streams that were opened for every configuration, optionally persisted into a file.
+ * @note Opening a stream is slow with OpenSL ES, this lets configurations that are known to fail be rejected without opening a stream for them.
+ *       Every stream that's opened probes the device, so the cache fills up as a side effect of regular use.
+ *       Failures are only hints, a change of the audio route can lift them, so they're trusted for a limited time after which the device is probed again.
+ */
+class CapabilityCache {
+  public:
+    struct Key {
+        oboe::AudioApi api;
+        oboe::Direction direction;
+        oboe::AudioFormat format;
+        int32_t sampleRate;
+        int32_t channelCount;
+
+        bool operator<(const Key& other) const {
+            return std::tie(api, direction, format, sampleRate, channelCount) < std::tie(other.api, other.direction, other.format, other.sampleRate, other.channelCount);
+        }
+    };
+
+    struct Capabilities {
+        int32_t capacityLimit; //!< The capacity that the device capped a stream at when a larger one was requested, 0 if it never did.
+        int32_t framesPerBurst;
+        bool unsupported; //!< If the device rejected the configuration outright.
+        int64_t checked; //!< The CLOCK_REALTIME time in seconds at which the capacity limit or rejection was last observed, the file outlives reboots so this isn't monotonic.
+    };
+
+    constexpr static int64_t FailureLifetimeSeconds{600}; //!< The time for which a capacity limit or rejection is trusted before the device is probed again.
+
+    /**
+     * @return The current time in the same clock as Capabilities::checked.
+     */
+    static int64_t GetTime() {
+        return static_cast<int64_t>(std::time(nullptr));
+    }
+
+  private:
+    static inline std::mutex mutex;
+    static inline std::map<Key, Capabilities> entries; //!< This is protected by the mutex.
+    static inline std::set<Key> unsaved; //!< The entries whose failures changed since they were last persisted, this is protected by the mutex.
+    static inline std::string path; //!< The file that the cache is persisted into, this is empty if it's only kept in memory. This is protected by the mutex.
+
+    /**
+     * @return If the capacity limit and rejection of the entry are recent enough to be trusted.
+     */
+    static bool IsFresh(const Capabilities& capabilities) {
+        return GetTime() - capabilities.checked < FailureLifetimeSeconds;
+    }
+
+    /**
+     * @brief Reads all entries persisted in the supplied file into the supplied map, entries that are already in it are kept.
+     */
+    static void Read(const std::string& file, std::map<Key, Capabilities>& target) {
+        FILE* input{std::fopen(file.c_str(), "re")};
+        if (!input)
+            return; // The file is created once the first entry is recorded.
+
+        char line[256];
+        while (std::fgets(line, sizeof(line), input)) {
+            int api, direction, format, unsupported;
+            long long checked;
+            Key key;
+            Capabilities capabilities;
+            if (std::sscanf(line, "%d %d %d %d %d %d %d %d %lld", &api, &direction, &format, &key.sampleRate, &key.channelCount, &capabilities.capacityLimit, &capabilities.framesPerBurst, &unsupported, &checked) != 9)
+                continue;
+            key.api = static_cast<oboe::AudioApi>(api);
+            key.direction = static_cast<oboe::Direction>(direction);
+            key.format = static_cast<oboe::AudioFormat>(format);
+            capabilities.unsupported = unsupported != 0;
+            capabilities.checked = checked;
+            target.emplace(key, capabilities);
+        }
+        std::fclose(input);
+    }
+
+    /**
+     * @brief Merges the supplied entries into the supplied file, this is called without the mutex held as it blocks on the disk.
+     * @param merged The entries that changed, the remaining entries of the file and the ones in the second map are added to it.
+     * @note Other processes can write the file concurrently, so the entries are merged into the latest contents of the file under an exclusive lock rather than replacing them.
+     *       The file itself is replaced atomically and synced prior to that, so that neither a concurrent load nor a crash can observe a partial write.
+     * @return If the file was written, it isn't if another process holds the lock.
+     */
+    static bool Save(const std::string& file, std::map<Key, Capabilities>& merged, const std::map<Key, Capabilities>& known) {
+        // The lock is never waited on as its holder may be stuck on the disk, the entries are retried by the next flush instead.
+        int lockFd{open((file + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)};
+        if (lockFd < 0 || flock(lockFd, LOCK_EX | LOCK_NB) != 0) {
+            if (lockFd < 0 || errno != EWOULDBLOCK)
+                std::cerr << "[ALSA Oboe] Failed to lock capability cache " << file << ": " << std::strerror(errno) << std::endl;
+            if (lockFd >= 0)
+                close(lockFd);
+            return false;
+        }
+
+        // Entries of other processes in the file are more recent than ours, besides the ones that changed.
+        Read(file, merged);
+        for (const auto& [key, capabilities] : known)
+            merged.emplace(key, capabilities);
+
+        std::string temporaryPath{file + ".tmp." + std::to_string(getpid())};
+        FILE* output{std::fopen(temporaryPath.c_str(), "we")};
+        bool written{output != nullptr};
+        if (output) {
+            for (const auto& [key, capabilities] : merged)
+                std::fprintf(output, "%d %d %d %d %d %d %d %d %lld\n", static_cast<int>(key.api), static_cast<int>(key.direction), static_cast<int>(key.format), key.sampleRate, key.channelCount, capabilities.capacityLimit, capabilities.framesPerBurst, capabilities.unsupported, static_cast<long long>(capabilities.checked));
+            written = std::fflush(output) == 0 && fsync(fileno(output)) == 0;
+            written = std::fclose(output) == 0 && written;
+            if (!written || std::rename(temporaryPath.c_str(), file.c_str()) != 0) {
+                written = false;
+                std::remove(temporaryPath.c_str());
+            }
+        }
+        if (!written)
+            std::cerr << "[ALSA Oboe] Failed to write capability cache " << file << ": " << std::strerror(errno) << std::endl;
+        close(lockFd); // This releases the lock.
+        return written;
+    }
+
+  public:
+    /**
+     * @brief Loads the entries persisted in the supplied file and persists all future entries into it, only the first file in the process is used.
+     */
+    static void Load(const std::string& file) {
+        std::scoped_lock lock{mutex};
+        if (!path.empty())
+            return;
+        path = file;
+        Read(path, entries); // Entries recorded by this process prior to loading are more recent than those of the file.
+    }
+
+    /**
+     * @return If the configuration has been probed before, a capacity limit or rejection that's no longer trusted is cleared from the supplied capabilities.
+     */
+    static bool Find(const Key& key, Capabilities& capabilities) {
+        std::scoped_lock lock{mutex};
+        auto it{entries.find(key)};
+        if (it == entries.end())
+            return false;
+        capabilities = it->second;
+        if (!IsFresh(capabilities)) {
+            capabilities.capacityLimit = 0;
+            capabilities.unsupported = false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Records the outcome of probing a configuration, this never touches the disk. See Flush.
+     * @note Only changes to the failures of the configuration are persisted, as well as a failure being observed again after it was no longer trusted.
+     *       Refreshing the time of a failure that's still trusted or recording the burst size alone doesn't rewrite the file every time a stream is opened.
+     */
+    static void Record(const Key& key, const Capabilities& capabilities) {
+        std::scoped_lock lock{mutex};
+        bool failed{capabilities.unsupported || capabilities.capacityLimit};
+        auto [it, inserted]{entries.try_emplace(key, capabilities)};
+        bool changed{inserted ? failed : it->second.unsupported != capabilities.unsupported || it->second.capacityLimit != capabilities.capacityLimit || (failed && !IsFresh(it->second))};
+        it->second = capabilities;
+        if (changed && !path.empty())
+            unsaved.insert(key);
+    }
+
+    /**
+     * @brief Persists the entries that changed since the last flush into the file of the cache, this is called by the service thread so no PCM waits on the disk.
+     */
+    static void Flush() {
+        std::string file;
+        std::map<Key, Capabilities> merged, known;
+        {
+            std::scoped_lock lock{mutex};
+            if (unsaved.empty())
+                return;
+            for (const Key& key : unsaved)
+                merged.emplace(key, entries.at(key));
+            unsaved.clear();
+            known = entries;
+            file = path;
+        }
+
+        std::set<Key> changed;
+        for (const auto& [key, capabilities] : merged)
+            changed.insert(key);
+        bool saved{Save(file, merged, known)};
+
+        std::scoped_lock lock{mutex};
+        if (!saved) {
+            unsaved.insert(changed.begin(), changed.end()); // The entries are retried on the next flush.
+            return;
+        }
+        for (const auto& [key, capabilities] : merged) {
+            // Entries recorded while the file was being written are more recent than it, they're persisted by the next flush.
+            if (!unsaved.count(key))
+                entries[key] = capabilities;
+        }
+    }
+
+    /**
+     * @return The smallest capacity limit recorded for the supplied direction in frames at the supplied rate, 0 if the device never capped a stream or the limits are no longer trusted.
+     * @note The capacity of streams is assumed to be limited in time rather than frames, so limits recorded at other rates are scaled to the supplied one.
+     */
+    static int32_t GetCapacityLimit(oboe::Direction direction, int32_t sampleRate) {
+        std::scoped_lock lock{mutex};
+        int32_t limit{};
+        for (const auto& [key, capabilities] : entries) {
+            if (key.direction != direction || !capabilities.capacityLimit || !IsFresh(capabilities))
+                continue;
+            auto scaled{static_cast<int32_t>(static_cast<int64_t>(capabilities.capacityLimit) * sampleRate / key.sampleRate)};
+            limit = limit ? std::min(limit, scaled) : scaled;
+        }
+        return limit;
+    }
+};
+
+/**
+ * @brief A packed 24-bit sample as used by SND_PCM_FORMAT_S24_3LE.
+ */
+struct Sample24 {
+    uint8_t bytes[3];
+};
+
+/**
+ * @brief The in-memory representation of the samples of every supported format and their conversion into floats in the range of [-1, 1].
+ */
+template <snd_pcm_format_t Format>
+struct SampleFormat;
+
+template <>
+struct SampleFormat<SND_PCM_FORMAT_S16_LE> {
+    using Type = int16_t;
+
+    static float ToFloat(Type sample) {
+        return static_cast<float>(sample) * (1.0f / 32768.0f);
+    }
+
+    static Type FromFloat(float value) {
+        return static_cast<Type>(std::clamp(value * 32768.0f, -32768.0f, 32767.0f));
+    }
+};
+
+template <>
+struct SampleFormat<SND_PCM_FORMAT_FLOAT_LE> {
+    using Type = float;
+
+    static float ToFloat(Type sample) {
+        return sample;
+    }
+
+    static Type FromFloat(float value) {
+        return value;
+    }
+};
+
+template <>
+struct SampleFormat<SND_PCM_FORMAT_S24_3LE> {
+    using Type = Sample24;
+
+    static float ToFloat(Type sample) {
+        // The sample is assembled in the upper 24 bits so that the sign is extended by the arithmetic shift.
+        int32_t value{static_cast<int32_t>((static_cast<uint32_t>(sample.bytes[0]) << 8) | (static_cast<uint32_t>(sample.bytes[1]) << 16) | (static_cast<uint32_t>(sample.bytes[2]) << 24)) >> 8};
+        return static_cast<float>(value) * (1.0f / 8388608.0f);
+    }
+
+    static Type FromFloat(float value) {
+        auto sample{static_cast<uint32_t>(static_cast<int32_t>(std::clamp(value * 8388608.0f, -8388608.0f, 8388607.0f)))};
+        return {{static_cast<uint8_t>(sample), static_cast<uint8_t>(sample >> 8), static_cast<uint8_t>(sample >> 16)}};
+    }
+};
+
+template <>
+struct SampleFormat<SND_PCM_FORMAT_S32_LE> {
+    using Type = int32_t;
+
+    static float ToFloat(Type sample) {
+        return static_cast<float>(sample) * (1.0f / 2147483648.0f);
+    }
+
+    static Type FromFloat(float value) {
+        // The upper bound isn't representable as a float, so values beyond the largest float below it are saturated separately.
+        float scaled{value * 2147483648.0f};
+        return scaled >= 2147483520.0f ? INT32_MAX : static_cast<Type>(std::max(scaled, -2147483648.0f));
+    }
+};
+
+/**
+ * @brief The kernels that move samples through the plugin, these are instantiated for every combination of format, channel count and access.
+ * @note Every parameter is a compile-time constant inside the kernels, so they contain no per-sample branching and the compiler can fully unroll and vectorize them.
+ *       The appropriate kernels are looked up once in the tables below when a stream is prepared.
+ */
+namespace kernels {
+    constexpr snd_pcm_format_t Formats[]{SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S32_LE};
+    constexpr unsigned int Channels[]{1, 2, 4, 6, 8};
+
+    using WriteFunction = void (*)(const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, uint8_t* output, size_t frames); //!< Writes frames from the application's areas into the ring.
+    using ReadFunction = void (*)(const uint8_t* input, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, size_t frames); //!< Reads captured frames from the ring into the application's areas.
+    using CopyFunction = void (*)(const uint8_t* input, uint8_t* output, size_t frames, LevelMeter::Accumulator& levels); //!< Copies frames from the ring into the stream while measuring them.
+    using MixFunction = void (*)(const uint8_t* input, float* output, size_t frames, const float* matrix, LevelMeter::Accumulator& levels); //!< Converts, measures and mixes frames from the ring into floating point frames of another channel layout.
+    using GainFunction = void (*)(uint8_t* samples, size_t frames, unsigned int channels, float& gain, float step); //!< Applies a gain that changes by a step after every frame to frames in the stream.
+
+    template <snd_pcm_format_t Format, unsigned int ChannelCount>
+    void WriteInterleaved(const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, uint8_t* output, size_t frames) {
+        using Sample = typename SampleFormat<Format>::Type;
+        auto& area{areas[0]};
+        std::memcpy(output, static_cast<const uint8_t*>(area.addr) + (area.first + offset * area.step) / 8, frames * ChannelCount * sizeof(Sample));
+    }
+
+    template <snd_pcm_format_t Format, unsigned int ChannelCount>
+    void WriteNonInterleaved(const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, uint8_t* output, size_t frames) {
+        using Sample = typename SampleFormat<Format>::Type;
+        auto* destination{reinterpret_cast<Sample*>(output)};
+        for (unsigned int c{}; c < ChannelCount; c++) {
+            auto& area{areas[c]};
+            auto* source{static_cast<const uint8_t*>(area.addr) + (area.first + offset * area.step) / 8};
+            size_t stride{area.step / 8};
+            for (size_t frame{}; frame < frames; frame++)
+                std::memcpy(&destination[frame * ChannelCount + c], source + frame * stride, sizeof(Sample));
+        }
+    }
+
+    template <snd_pcm_format_t Format, unsigned int ChannelCount>
+    void ReadInterleaved(const uint8_t* input, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, size_t frames) {
+        using Sample = typename SampleFormat<Format>::Type;
+        auto& area{areas[0]};
+        std::memcpy(static_cast<uint8_t*>(area.addr) + (area.first + offset * area.step) / 8, input, frames * ChannelCount * sizeof(Sample));
+    }
+
+    template <snd_pcm_format_t Format, unsigned int ChannelCount>
+    void ReadNonInterleaved(const uint8_t* input, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, size_t frames) {
+        using Sample = typename SampleFormat<Format>::Type;
+        auto* source{reinterpret_cast<const Sample*>(input)};
+        for (unsigned int c{}; c < ChannelCount; c++) {
+            auto& area{areas[c]};
+            auto* destination{static_cast<uint8_t*>(area.addr) + (area.first + offset * area.step) / 8};
+            size_t stride{area.step / 8};
+            for (size_t frame{}; frame < frames; frame++)
+                std::memcpy(destination + frame * stride, &source[frame * ChannelCount + c], sizeof(Sample));
+        }
+    }
+
+    template <snd_pcm_format_t Format, unsigned int ChannelCount>
+    void Copy(const uint8_t* __restrict input, uint8_t* __restrict output, size_t frames, LevelMeter::Accumulator& levels) {
+        using Sample = typename SampleFormat<Format>::Type;
+        auto* source{reinterpret_cast<const Sample*>(input)};
+        auto* destination{reinterpret_cast<Sample*>(output)};
+
+        // The levels are accumulated in independent lanes which are a multiple of the channel count, so that the loop body is a fixed-width vector operation.
+        // The lanes are folded into their channels at the end, this avoids a loop-carried dependency on a single accumulator per channel.
+        constexpr size_t Lanes{std::lcm<size_t>(ChannelCount, 8)};
+        float peak[Lanes]{}, sumSquares[Lanes]{};
+
+        size_t samples{frames * ChannelCount}, index{};
+        for (; index + Lanes <= samples; index += Lanes) {
+            for (size_t lane{}; lane < Lanes; lane++) {
+                Sample sample{source[index + lane]};
+                destination[index + lane] = sample;
+                float value{SampleFormat<Format>::ToFloat(sample)};
+                peak[lane] = std::max(peak[lane], std::fabs(value));
+                sumSquares[lane] += value * value;
+            }
+        }
+        for (size_t lane{}; index < samples; index++, lane++) {
+            Sample sample{source[index]};
+            destination[index] = sample;
+            float value{SampleFormat<Format>::ToFloat(sample)};
+            peak[lane] = std::max(peak[lane], std::fabs(value));
+            sumSquares[lane] += value * value;
+        }
+
+        for (size_t lane{}; lane < Lanes; lane++) {
+            levels.peak[lane % ChannelCount] = std::max(levels.peak[lane % ChannelCount], peak[lane]);
+            levels.sumSquares[lane % ChannelCount] += sumSquares[lane];
+        }
+    }
+
+    template <snd_pcm_format_t Format, unsigned int InputChannels, unsigned int OutputChannels>
+    void Mix(const uint8_t* __restrict input, float* __restrict output, size_t frames, const float* __restrict matrix, LevelMeter::Accumulator& levels) {
+        using Sample = typename SampleFormat<Format>::Type;
+        auto* source{reinterpret_cast<const Sample*>(input)};
+
+        // The coefficients are copied locally so the compiler can keep them in registers, the accumulators are local for the same reason.
+        float coefficients[OutputChannels * InputChannels], peak[InputChannels], sumSquares[InputChannels];
+        std::copy(matrix, matrix + OutputChannels * InputChannels, coefficients);
+        std::copy(levels.peak, levels.peak + InputChannels, peak);
+        std::copy(levels.sumSquares, levels.sumSquares + InputChannels, sumSquares);
+
+        for (size_t frame{}; frame < frames; frame++) {
+            float samples[InputChannels];
+            for (unsigned int i{}; i < InputChannels; i++) {
+                samples[i] = SampleFormat<Format>::ToFloat(source[frame * InputChannels + i]);
+                peak[i] = std::max(peak[i], std::fabs(samples[i]));
+                sumSquares[i] += samples[i] * samples[i];
+            }
+
+            for (unsigned int o{}; o < OutputChannels; o++) {
+                float value{};
+                for (unsigned int i{}; i < InputChannels; i++)
+                    value += coefficients[o * InputChannels + i] * samples[i];
+                output[frame * OutputChannels + o] = value;
+            }
+        }
+
+        std::copy(peak, peak + InputChannels, levels.peak);
+        std::copy(sumSquares, sumSquares + InputChannels, levels.sumSquares);
+    }
+
+    /**
+     * @brief The instruction sets that the kernels are compiled for in addition to the baseline of the target, the best one supported by the CPU is selected at runtime.
+     * @note NEON is part of the AArch64 baseline and SSE2 of the x86-64 baseline, so those are covered by the baseline variant.
+     */
+    enum class Isa {
+        Baseline,
+        Sse41, //!< x86-64 with SSE4.1.
+        Avx2, //!< x86-64 with AVX2 and FMA.
+        Sve, //!< AArch64 with SVE.
+    };
+
+    inline const char* ToString(Isa isa) {
+        switch (isa) {
+            case Isa::Baseline:
+                return "baseline";
+            case Isa::Sse41:
+                return "SSE4.1";
+            case Isa::Avx2:
+                return "AVX2";
+            case Isa::Sve:
+                return "SVE";
+        }
+        return "unknown";
+    }
+
+    /**
+     * @return The best instruction set supported by the current CPU that the kernels have been compiled for.
+     */
+    inline Isa DetectIsa() {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return Isa::Avx2;
+        if (__builtin_cpu_supports("sse4.1"))
+            return Isa::Sse41;
+#elif defined(__aarch64__)
+#ifndef HWCAP_SVE
+        constexpr unsigned long HWCAP_SVE{1UL << 22}; // Older libc headers don't define this.
+#endif
+        if (getauxval(AT_HWCAP) & HWCAP_SVE)
+            return Isa::Sve;
+#endif
+        return Isa::Baseline;
+    }
+
+    /**
+     * @brief A kernel compiled for a specific instruction set, the generic kernel is flattened into a function with the target attributes of the instruction set.
+     * @note Inlining a kernel into a function with a superset of its instruction set is always permitted, the inlined body is then vectorized for the wider target.
+     */
+    template <Isa Target, auto Kernel, typename = decltype(Kernel)>
+    struct Variant;
+
+    template <auto Kernel, typename... Args>
+    struct Variant<Isa::Baseline, Kernel, void (*)(Args...)> {
+        [[gnu::flatten]] static void Function(Args... args) {
+            Kernel(args...);
+        }
+    };
+
+#if defined(__x86_64__)
+    template <auto Kernel, typename... Args>
+    struct Variant<Isa::Sse41, Kernel, void (*)(Args...)> {
+        [[gnu::target("sse4.1"), gnu::flatten]] static void Function(Args... args) {
+            Kernel(args...);
+        }
+    };
+
+    template <auto Kernel, typename... Args>
+    struct Variant<Isa::Avx2, Kernel, void (*)(Args...)> {
+        [[gnu::target("avx2,fma"), gnu::flatten]] static void Function(Args... args) {
+            Kernel(args...);
+        }
+    };
+#elif defined(__aarch64__)
+    template <auto Kernel, typename... Args>
+    struct Variant<Isa::Sve, Kernel, void (*)(Args...)> {
+#ifdef __clang__
+        [[gnu::target("sve"), gnu::flatten]]
+#else
+        [[gnu::target("+sve"), gnu::flatten]]
+#endif
+        static void Function(Args... args) {
+            Kernel(args...);
+        }
+    };
+#endif
+
+    template <snd_pcm_format_t Format>
+    void Gain(uint8_t* samples, size_t frames, unsigned int channels, float& gain, float step) {
+        using Sample = typename SampleFormat<Format>::Type;
+        auto* data{reinterpret_cast<Sample*>(samples)};
+        for (size_t frame{}; frame < frames; frame++, gain += step)
+            for (unsigned int c{}; c < channels; c++)
+                data[frame * channels + c] = SampleFormat<Format>::FromFloat(SampleFormat<Format>::ToFloat(data[frame * channels + c]) * gain);
+    }
+
+    constexpr GainFunction GainTable[]{&Gain<Formats[0]>, &Gain<Formats[1]>, &Gain<Formats[2]>, &Gain<Formats[3]>}; //!< Indexed by [format], gain is rarely applied so this isn't specialized further.
+
+    constexpr size_t FormatCount{std::size(Formats)}, ChannelCount{std::size(Channels)};
+
+    template <Isa Target, size_t... Indices>
+    constexpr auto MakeWriteTable(std::index_sequence<Indices...>) {
+        // The first half of the table is for interleaved access, the second half for non-interleaved access.
+        constexpr size_t Half{FormatCount * ChannelCount};
+        return std::array<WriteFunction, sizeof...(Indices)>{(Indices < Half ? &Variant<Target, &WriteInterleaved<Formats[Indices % Half / ChannelCount], Channels[Indices % ChannelCount]>>::Function : &Variant<Target, &WriteNonInterleaved<Formats[Indices % Half / ChannelCount], Channels[Indices % ChannelCount]>>::Function)...};
+    }
+
+    template <Isa Target, size_t... Indices>
+    constexpr auto MakeReadTable(std::index_sequence<Indices...>) {
+        constexpr size_t Half{FormatCount * ChannelCount};
+        return std::array<ReadFunction, sizeof...(Indices)>{(Indices < Half ? &Variant<Target, &ReadInterleaved<Formats[Indices % Half / ChannelCount], Channels[Indices % ChannelCount]>>::Function : &Variant<Target, &ReadNonInterleaved<Formats[Indices % Half / ChannelCount], Channels[Indices % ChannelCount]>>::Function)...};
+    }
+
+    template <Isa Target, size_t... Indices>
+    constexpr auto MakeCopyTable(std::index_sequence<Indices...>) {
+        return std::array<CopyFunction, sizeof...(Indices)>{&Variant<Target, &Copy<Formats[Indices / ChannelCount], Channels[Indices % ChannelCount]>>::Function...};
+    }
+
+    template <Isa Target, size_t... Indices>
+    constexpr auto MakeMixTable(std::index_sequence<Indices...>) {
+        return std::array<MixFunction, sizeof...(Indices)>{&Variant<Target, &Mix<Formats[Indices / (ChannelCount * ChannelCount)], Channels[Indices / ChannelCount % ChannelCount], Channels[Indices % ChannelCount]>>::Function...};
+    }
+
+    /**
+     * @brief The kernels of every configuration for a single instruction set.
+     */
+    struct Tables {
+        std::array<WriteFunction, 2 * FormatCount * ChannelCount> write; //!< Indexed by [access][format][channels].
+        std::array<ReadFunction, 2 * FormatCount * ChannelCount> read; //!< Indexed by [access][format][channels].
+        std::array<CopyFunction, FormatCount * ChannelCount> copy; //!< Indexed by [format][channels].
+        std::array<MixFunction, FormatCount * ChannelCount * ChannelCount> mix; //!< Indexed by [format][input channels][output channels].
+    };
+
+    template <Isa Target>
+    constexpr Tables MakeTables() {
+        return {
+            MakeWriteTable<Target>(std::make_index_sequence<2 * FormatCount * ChannelCount>{}),
+            MakeReadTable<Target>(std::make_index_sequence<2 * FormatCount * ChannelCount>{}),
+            MakeCopyTable<Target>(std::make_index_sequence<FormatCount * ChannelCount>{}),
+            MakeMixTable<Target>(std::make_index_sequence<FormatCount * ChannelCount * ChannelCount>{}),
+        };
+    }
+
+    /**
+     * @return The instruction set that the kernels are used with, this is only detected once per process.
+     */
+    inline Isa GetIsa() {
+        static const Isa isa{DetectIsa()};
+        return isa;
+    }
+
+    inline const Tables& GetTables() {
+        constexpr static Tables BaselineTables{MakeTables<Isa::Baseline>()};
+#if defined(__x86_64__)
+        constexpr static Tables Sse41Tables{MakeTables<Isa::Sse41>()}, Avx2Tables{MakeTables<Isa::Avx2>()};
+        if (GetIsa() == Isa::Avx2)
+            return Avx2Tables;
+        if (GetIsa() == Isa::Sse41)
+            return Sse41Tables;
+#elif defined(__aarch64__)
+        constexpr static Tables SveTables{MakeTables<Isa::Sve>()};
+        if (GetIsa() == Isa::Sve)
+            return SveTables;
+#endif
+        return BaselineTables;
+    }
+
+    /**
+     * @brief The kernels for a specific configuration of a PCM, any of these are null if the configuration isn't supported by them.
+     */
+    struct Selection {
+        WriteFunction write{};
+        ReadFunction read{};
+        CopyFunction copy{};
+        MixFunction mix{};
+        GainFunction gain{}; //!< Applies to the format of the stream rather than that of the application.
+    };
+
+    /**
+     * @param outputChannels The channel count of the stream, the mix kernel is only selected if this differs from the channel count of the application.
+     * @param floatOutput If the stream uses floating point samples regardless of the format of the application, the mix kernel is selected to convert them if required.
+     */
+    inline Selection Select(snd_pcm_format_t format, snd_pcm_access_t access, unsigned int channels, unsigned int outputChannels, bool floatOutput) {
+        // The stream only differs from the format of the application when it uses floating point samples.
+        snd_pcm_format_t outputFormat{floatOutput ? SND_PCM_FORMAT_FLOAT_LE : format};
+        auto formatIt{std::find(std::begin(Formats), std::end(Formats), format)};
+        auto channelIt{std::find(std::begin(Channels), std::end(Channels), channels)}, outputChannelIt{std::find(std::begin(Channels), std::end(Channels), outputChannels)};
+        if (formatIt == std::end(Formats) || channelIt == std::end(Channels) || outputChannelIt == std::end(Channels))
+            return {};
+
+        size_t formatIndex(formatIt - std::begin(Formats)), channelIndex(channelIt - std::begin(Channels)), outputChannelIndex(outputChannelIt - std::begin(Channels));
+        size_t accessIndex{access == SND_PCM_ACCESS_RW_NONINTERLEAVED ? 1U : 0U};
+
+        const Tables& tables{GetTables()};
+        size_t areaIndex{(accessIndex * FormatCount + formatIndex) * ChannelCount + channelIndex};
+        Selection selection{.write = tables.write[areaIndex], .read = tables.read[areaIndex]};
+        if (channels == outputChannels && (!floatOutput || format == SND_PCM_FORMAT_FLOAT_LE))
+            selection.copy = tables.copy[formatIndex * ChannelCount + channelIndex];
+        else
+            selection.mix = tables.mix[(formatIndex * ChannelCount + channelIndex) * ChannelCount + outputChannelIndex];
+        selection.gain = GainTable[std::find(std::begin(Formats), std::end(Formats), outputFormat) - std::begin(Formats)];
+        return selection;
+    }
+}
+
+/**
+ * @brief The options of a PCM that can be supplied in its ALSA configuration.
+ */
+struct OboePcmConfig {
+    std::string linkGroup; //!< The name of a group of PCMs in the process that are started and stopped together, this is empty if the PCM isn't linked.
+    std::string duplexGroup; //!< The name of a pair of a playback and a capture PCM in the process whose input is read in lockstep with the output, this is empty if the PCM isn't paired.
+    unsigned int deviceChannels{}; //!< The channel count that the device is driven with, any other channel count is converted by the plugin. 0 if the device follows the channel count of the application.
+    unsigned int deviceRate{}; //!< The sample rate that the device is driven with, any other rate is resampled by the plugin. 0 if the device follows the rate of the application.
+    unsigned int latencyMilliseconds{}; //!< The target latency from a write to its presentation that all buffer parameters are derived from, 0 if they're left to the application.
+    unsigned int prefillBursts{}; //!< The amount of bursts of silence that are queued ahead of the ring whenever the stream is started.
+    unsigned int watchdogMilliseconds{500}; //!< The time without a data callback after which a running stream is considered stalled and rebuilt, 0 disables the watchdog.
+    unsigned int transitionTimeoutMilliseconds{}; //!< The time that a state transition of the stream is given before the stream is forcibly rebuilt, 0 derives it from the buffer of the stream.
+    unsigned int idleTimeoutMilliseconds{}; //!< The time that the stream keeps running after the ring was stopped, 0 stops it as soon as the ring is.
+    bool overrunXrun{}; //!< If an overrun of the capture ring is reported to the application as an xrun, otherwise the input that doesn't fit is dropped silently.
+    oboe::InputPreset inputPreset{oboe::InputPreset::VoiceRecognition}; //!< The input preset that capture streams are opened with, this selects the processing that Android applies to the input.
+    std::string tapDirectory; //!< The directory that WAV taps of the audio exchanged with the application are recorded into, this is empty if tapping is disabled.
+    bool tapDevice{}; //!< If the audio exchanged with the device is tapped as well, after all conversions by the plugin. This only applies to playback.
+    std::string traceFile; //!< The path that a trace of all ioplug callbacks is recorded into, this is empty if tracing is disabled.
+    std::string capabilityCache; //!< The path that the capabilities of the device are persisted into, this is empty if they're only kept in memory.
+
+    /**
+     * @brief Reads a string option into the supplied value, the error is reported to ALSA if the option isn't a string.
+     */
+    static int GetString(snd_config_t* node, const char* id, std::string& value) {
+        const char* string;
+        if (snd_config_get_string(node, &string) < 0) {
+            SNDERR("Invalid type for %s", id);
+            return -EINVAL;
+        }
+        value = string;
+        return 0;
+    }
+
+    /**
+     * @brief Reads an integer option into the supplied value, the error is reported to ALSA if the option isn't an integer or isn't accepted by the validator.
+     */
+    static int GetInteger(snd_config_t* node, const char* id, bool (*valid)(long value), unsigned int& value) {
+        long integer;
+        if (snd_config_get_integer(node, &integer) < 0 || !valid(integer)) {
+            SNDERR("Invalid value for %s", id);
+            return -EINVAL;
+        }
+        value = static_cast<unsigned int>(integer);
+        return 0;
+    }
+
+    /**
+     * @brief Reads a boolean option into the supplied value, the error is reported to ALSA if the option isn't a boolean.
+     */
+    static int GetBool(snd_config_t* node, const char* id, bool& value) {
+        int boolean{snd_config_get_bool(node)};
+        if (boolean < 0) {
+            SNDERR("Invalid value for %s", id);
+            return -EINVAL;
+        }
+        value = boolean;
+        return 0;
+    }
+
+    /**
+     * @brief Reads the name of an input preset into the supplied value, the error is reported to ALSA if the name isn't one of the presets.
+     */
+    static int GetInputPreset(snd_config_t* node, const char* id, oboe::InputPreset& value) {
+        constexpr std::pair<const char*, oboe::InputPreset> Presets[]{
+            {"generic", oboe::InputPreset::Generic},
+            {"camcorder", oboe::InputPreset::Camcorder},
+            {"voice_recognition", oboe::InputPreset::VoiceRecognition},
+            {"voice_communication", oboe::InputPreset::VoiceCommunication},
+            {"unprocessed", oboe::InputPreset::Unprocessed},
+            {"voice_performance", oboe::InputPreset::VoicePerformance},
+        };
+
+        std::string name;
+        int err{GetString(node, id, name)};
+        if (err < 0)
+            return err;
+        auto preset{std::find_if(std::begin(Presets), std::end(Presets), [&name](const auto& entry) { return name == entry.first; })};
+        if (preset == std::end(Presets)) {
+            SNDERR("Invalid value for %s: %s", id, name.c_str());
+            return -EINVAL;
+        }
+        value = preset->second;
+        return 0;
+    }
+
+    int Parse(snd_config_t* conf) {
+        struct StringOption {
+            const char* id;
+            std::string OboePcmConfig::*value;
+        };
+        constexpr static StringOption StringOptions[]{
+            {"link_group", &OboePcmConfig::linkGroup},
+            {"duplex_group", &OboePcmConfig::duplexGroup},
+            {"tap_dir", &OboePcmConfig::tapDirectory},
+            {"trace_file", &OboePcmConfig::traceFile},
+            {"capability_cache", &OboePcmConfig::capabilityCache},
+        };
+
+        struct IntegerOption {
+            const char* id;
+            unsigned int OboePcmConfig::*value;
+            bool (*valid)(long value);
+        };
+        constexpr static IntegerOption IntegerOptions[]{
+            {"latency_ms", &OboePcmConfig::latencyMilliseconds, [](long value) { return value > 0 && value <= 1000; }},
+            {"prefill_bursts", &OboePcmConfig::prefillBursts, [](long value) { return value >= 0 && value <= 16; }},
+            {"watchdog_ms", &OboePcmConfig::watchdogMilliseconds, [](long value) { return value >= 0; }},
+            {"transition_timeout_ms", &OboePcmConfig::transitionTimeoutMilliseconds, [](long value) { return value >= 0; }},
+            {"idle_timeout_ms", &OboePcmConfig::idleTimeoutMilliseconds, [](long value) { return value >= 0; }},
+            {"device_rate", &OboePcmConfig::deviceRate, [](long value) { return value == 0 || (value >= 8000 && value <= 192000); }},
+            {"device_channels", &OboePcmConfig::deviceChannels, [](long value) { return value == 0 || !GetChannelPositions(static_cast<unsigned int>(value)).empty(); }},
+        };
+
+        struct BoolOption {
+            const char* id;
+            bool OboePcmConfig::*value;
+        };
+        constexpr static BoolOption BoolOptions[]{
+            {"tap_device", &OboePcmConfig::tapDevice},
+            {"overrun_xrun", &OboePcmConfig::overrunXrun},
+        };
+
+        snd_config_iterator_t i, next;
+        snd_config_for_each(i, next, conf) {
+            snd_config_t* node{snd_config_iterator_entry(i)};
+            const char* id;
+            if (snd_config_get_id(node, &id) < 0)
+                continue;
+            if (std::strcmp(id, "comment") == 0 || std::strcmp(id, "type") == 0 || std::strcmp(id, "hint") == 0)
+                continue;
+
+            auto find{[id](const auto& options) {
+                auto it{std::find_if(std::begin(options), std::end(options), [id](const auto& option) { return std::strcmp(option.id, id) == 0; })};
+                return it != std::end(options) ? &*it : nullptr;
+            }};
+
+            int err;
+            if (auto* string{find(StringOptions)}) {
+                err = GetString(node, id, this->*string->value);
+            } else if (auto* integer{find(IntegerOptions)}) {
+                err = GetInteger(node, id, integer->valid, this->*integer->value);
+            } else if (auto* boolean{find(BoolOptions)}) {
+                err = GetBool(node, id, this->*boolean->value);
+            } else if (std::strcmp(id, "input_preset") == 0) {
+                err = GetInputPreset(node, id, inputPreset);
+            } else {
+                SNDERR("Unknown field %s", id);
+                err = -EINVAL;
+            }
+            if (err < 0)
+                return err;
+        }
+        return 0;
+    }
+};
 
 /**
  * @brief An ALSA PCM I/O plugin that uses Oboe for playing audio on Android.
- * @note This currently only supports playback, capture is not supported.
+ * @note Capture uses the same ring in the opposite direction, the data callback fills it and the application drains it.
  * @note The default backend is currently OpenSL as AAudio is broken on some devices.
+ * @note Samples written by the application are queued in a ring buffer that mirrors the ALSA buffer, the Oboe data callback drains it.
+ *       This lets us report the position that the device has actually consumed rather than what the application has written.
+ * @note A playback and a capture PCM can be paired into a full-duplex stream, the input is then read by the data callback of the output rather than its own.
+ *       This keeps both directions on a single clock from the perspective of the application, similar to oboe::FullDuplexStream.
  */
 class OboePcm {
   private:
+    /**
+     * @brief Forwards the data callbacks of a stream to the instance that owns it, the stream is detached from its instance once it's replaced.
+     * @note Closing a replaced stream can block for arbitrarily long on a hung device, so that's left to the service thread. The instance may be destroyed in the meantime,
+     *       any callback of the stream after it has been detached only produces silence and stops the stream.
+     */
+    class StreamCallback : public oboe::AudioStreamDataCallback {
+      private:
+        std::atomic<OboePcm*> instance;
+        std::atomic<bool> forwarding{}; //!< If a callback is being forwarded to the instance, Detach waits on this.
+
+      public:
+        explicit StreamCallback(OboePcm* target) : instance{target} {}
+
+        oboe::DataCallbackResult onAudioReady(oboe::AudioStream* audioStream, void* audioData, int32_t numFrames) override {
+            // This is sequentially consistent to pair with Detach, either it observes the instance being detached or it waits for us to return.
+            forwarding.store(true);
+            oboe::DataCallbackResult result{oboe::DataCallbackResult::Stop};
+            if (OboePcm* target{instance.load()})
+                result = target->Render(audioStream, audioData, numFrames);
+            else
+                std::memset(audioData, 0, static_cast<size_t>(numFrames) * static_cast<size_t>(audioStream->getBytesPerFrame()));
+            forwarding.store(false);
+            return result;
+        }
+
+        /**
+         * @brief Stops forwarding callbacks to the instance, this waits for a callback that's being forwarded to return.
+         */
+        void Detach() {
+            instance.store(nullptr);
+            while (forwarding.load())
+                std::this_thread::yield();
+        }
+    };
+
+    /**
+     * @brief A stream that has been replaced and is waiting to be closed by the service thread.
+     */
+    struct RetiredStream {
+        std::shared_ptr<StreamCallback> callback; //!< This is declared first so that it outlives the stream.
+        std::shared_ptr<oboe::AudioStream> stream;
+    };
+
     std::mutex mutex;
     std::shared_ptr<oboe::AudioStream> stream;
-    constexpr static int64_t TimeoutNanoseconds{36000000000}; //!< An hour in nanoseconds, this is an arbitrarily long timeout that should never be reached.
+    std::shared_ptr<StreamCallback> streamCallback; //!< Forwards the data callbacks of the stream to this instance, this is null for a stream without a data callback.
+    std::atomic<bool> closing{}; //!< Set once the PCM is being closed, a drain that's waited on is abandoned so the close doesn't block on it.
+    constexpr static int64_t MinimumTransitionTimeoutNanoseconds{100000000}; //!< The lower bound of derived transition timeouts, streams with tiny buffers still need time for a scheduling hiccup.
+    constexpr static int64_t TransitionTimeoutBuffers{4}; //!< The derived transition timeout in multiples of the buffer duration of the stream, a transition settles within a few bursts on a healthy device.
+    constexpr static int64_t WaitSliceNanoseconds{10000000}; //!< The longest single wait for a state change, the state is re-read after every slice so a lost wakeup only costs a slice.
 
-    static int Start(snd_pcm_ioplug_t* ext) {
-        auto* self{static_cast<OboePcm*>(ext->private_data)};
-        std::scoped_lock lock{self->mutex};
-        if (!self->stream)
-            return -EBADFD; // This should be checked by pcm_ioplug but we'll do it here too.
+    static inline std::mutex instancesMutex; //!< Protects the instances list, this must be locked prior to the mutex of an instance.
+    static inline std::vector<OboePcm*> instances; //!< All live instances in the process, used to resolve handles passed into the public API.
+
+    /**
+     * @brief A set of instances that are started and stopped together, pcm_ioplug doesn't implement snd_pcm_link() so this is our equivalent of it.
+     */
+    struct LinkGroup {
+        std::mutex mutex; //!< Serializes transitions of the group and protects its members, this must be locked after instancesMutex but prior to the mutex of any member.
+        std::vector<OboePcm*> members;
+    };
+    std::shared_ptr<LinkGroup> linkGroup; //!< The group this instance is linked to, if any. Modifications require instancesMutex, the mutex of the group and the mutex of the instance.
+    std::atomic<int> linkedState{-1}; //!< The ALSA state that another member of the group transitioned this instance to, -1 if none. It's applied by the next callback that ALSA invokes with the lock of this PCM held.
+    static inline std::unordered_map<std::string, std::weak_ptr<LinkGroup>> namedLinkGroups; //!< Groups joined via the link_group option, this is protected by instancesMutex.
+
+  public:
+    constexpr static unsigned int MeterSlots{4}; //!< The amount of instances that can have their levels exposed as controls at the same time.
+
+  private:
+    static inline OboePcm* meterSlots[MeterSlots]{}; //!< The instances that have their levels exposed as controls, this is protected by instancesMutex.
+
+    constexpr static int64_t ServiceIntervalNanoseconds{50000000}; //!< The interval at which the service thread checks on all instances.
+    static inline std::mutex serviceMutex; //!< Protects the state of the service thread, this is independent of all other mutexes.
+    static inline std::condition_variable serviceCondition;
+    static inline std::thread serviceThread; //!< A thread that watches over all instances in the process, it runs while any instance is alive.
+    static inline size_t serviceReferences{}; //!< The amount of instances that are keeping the service thread alive.
+    static inline uint64_t serviceGeneration{}; //!< Incremented whenever the service thread is asked to exit, so that a thread which is being joined can't be confused with its replacement.
+    static inline uint64_t serviceExits{}; //!< One past the latest generation of the service thread that has exited, ReleaseService only joins a thread once it's covered by this.
+    constexpr static int64_t ServiceExitTimeoutNanoseconds{1000000000}; //!< The time that the service thread is given to exit, it's detached rather than joined if it's stuck on a hung device.
+    static inline std::vector<RetiredStream> retiredStreams; //!< Streams waiting to be closed by the service thread, this is protected by serviceMutex.
+    static inline bool serviceRequested{}; //!< If the service thread should check on all instances without waiting for the next interval, this is protected by serviceMutex.
+
+    bool capture{}; //!< If the PCM captures audio, the data callback fills the ring rather than draining it.
+    int eventFd{-1}; //!< An eventfd used as the poll descriptor, it is signalled by the data callback whenever space frees up in the ring.
+    int drainEventFd{-1}; //!< An eventfd that the data callback signals once the end marker of a drain has been presented, Drain blocks on it.
+    std::unique_ptr<uint8_t[]> ring; //!< The ring buffer holding samples that have been written by the application but not yet consumed by Oboe.
+    snd_pcm_uframes_t ringFrames{}; //!< The size of the ring in frames, this is always the ALSA buffer size.
+    size_t frameSize{}; //!< The size of a single frame in bytes.
+    unsigned int configuredChannels{}; //!< The channel count that the device is configured to be driven with, 0 if it follows the application.
+    unsigned int deviceChannels{}; //!< The channel count that the stream is opened with.
+    std::unique_ptr<ChannelMixer> mixer; //!< The mixer used to convert from the channel layout of the ring to that of the stream, this is null when they match.
+    size_t outputFrameSize{}; //!< The size of a single frame in the stream in bytes, this differs from frameSize when the mixer is used.
+    unsigned int deviceRate{}; //!< The sample rate that the stream is opened with, 0 if it follows the rate of the application.
+    unsigned int streamRate{}; //!< The sample rate of the stream, this differs from the rate of the application when the resampler is used.
+    std::unique_ptr<oboe::resampler::MultiChannelResampler> resampler; //!< Converts from the rate of the application to the rate of the stream, this is null when they match.
+    constexpr static size_t ResampleBlockFrames{64}; //!< The amount of frames that are converted from the ring at once for the resampler.
+    std::vector<float> resampleBlock; //!< Frames that have been converted from the ring but not yet fed into the resampler, these are still accounted for as queued in the ring.
+    size_t resampleBlockOffset{}; //!< The index of the next frame in the block that will be fed into the resampler, this is only accessed by the data callback.
+    size_t resampleBlockFrames{}; //!< The amount of valid frames in the block, this is only accessed by the data callback.
+    kernels::Selection kernels; //!< The kernels selected for the configuration of the PCM during prepare.
+    LevelMeter meter; //!< The levels of the audio written by the application, measured as it's copied out of the ring.
+    std::atomic<uint64_t> underruns{}; //!< The amount of callbacks which couldn't be completely filled from the ring while the stream was running.
+    std::atomic<uint64_t> overruns{}; //!< The amount of times captured input didn't fit into the ring as the application didn't read it in time.
+    std::atomic<uint64_t> overrunFrames{}; //!< The amount of captured frames that were dropped due to overruns.
+    bool overrunXrun{}; //!< If overruns are reported to the application as an xrun.
+    std::atomic<bool> overrunPending{}; //!< If an overrun occurred that hasn't been reported yet, the ring stops being filled until the PCM is prepared again. This is only used when overrunXrun is set.
+    oboe::InputPreset inputPreset{}; //!< The input preset that the stream is opened with when capturing.
+    std::unique_ptr<std::atomic<int64_t>[]> periodTimestamps; //!< The CLOCK_MONOTONIC time at which the first frame of each period in the capture ring was captured, indexed by the period within the ring.
+    size_t periodCount{}; //!< The amount of periods in the ring, this is the size of periodTimestamps.
+    std::string tapDirectory; //!< The directory that taps are recorded into, this is empty if tapping is disabled.
+    bool tapDevice{}; //!< If deviceTap should be recorded alongside applicationTap.
+    std::unique_ptr<WavTap> applicationTap; //!< Records the frames exchanged with the application in Transfer, this is null unless tapping is enabled.
+    std::unique_ptr<WavTap> deviceTap; //!< Records the frames handed to the stream by the data callback, this is only replaced while the ring isn't consumed.
+    static inline std::atomic<unsigned int> tapSerial{}; //!< Distinguishes the taps of all instances in the process.
+    std::unique_ptr<TraceRecorder> trace; //!< Records all ioplug callbacks, this is null unless tracing is enabled. It's set prior to the PCM being returned to the application.
+    int meterSlot{-1}; //!< The index of the meter controls exposed by the control plugin for this instance, -1 if all slots were taken. This is protected by instancesMutex.
+    std::atomic<uint64_t> applPosition{}; //!< The total amount of frames written into the ring by the application, or read from it when capturing.
+    std::atomic<uint64_t> hwPosition{}; //!< The total amount of frames consumed from the ring by the data callback, or captured into it.
+    snd_pcm_uframes_t boundary{}; //!< The ALSA boundary that the hardware pointer wraps around at, supplied via sw_params.
+    snd_pcm_uframes_t availMin{}; //!< The minimum amount of available frames before the application should be woken up.
+    bool periodEvent{}; //!< If the application requested to be woken up at every period boundary regardless of the available frames (SND_PCM_PERIOD_EVENT).
+    std::atomic<bool> periodEventPending{}; //!< If a period boundary has been crossed since the last poll, this is only used when periodEvent is set.
+    StatusPage status; //!< The position published by the data callback, this is what Pointer and Delay report without touching the stream.
+    int64_t scheduledStart{}; //!< The CLOCK_MONOTONIC time in nanoseconds at which the first frame after the next start should be presented, 0 if unscheduled.
+    std::atomic<int64_t> startTarget{}; //!< The scheduled start time that the data callback is padding towards, 0 once the ring has been started.
+    std::atomic<int64_t> triggerTimestamp{}; //!< The CLOCK_MONOTONIC time in nanoseconds at which the stream was last started.
+    int64_t openTimestamp{}; //!< The time at which the application started opening the PCM.
+    int64_t openedTimestamp{}; //!< The time at which opening the PCM completed, Oboe isn't touched until the PCM is prepared.
+    int64_t readyTimestamp{}; //!< The time at which the first stream of the PCM was opened, 0 if it hasn't been yet.
+    unsigned int latencyMilliseconds{}; //!< The target latency of the PCM, 0 if the buffer parameters are left to the application.
+    snd_pcm_uframes_t startThreshold{}; //!< The amount of frames that need to be queued in the ring before a write automatically starts the stream.
+    bool startDeferred{}; //!< If ALSA started the PCM before startThreshold was reached, the ring is then started by the write that reaches it. This is protected by the mutex.
+    unsigned int prefillBursts{}; //!< The amount of bursts of silence that are played ahead of the ring after every start.
+    std::atomic<int64_t> prefillFrames{}; //!< The amount of silence that the data callback still needs to play before the ring.
+    int64_t watchdogTimeout{}; //!< The time in nanoseconds without a data callback after which a running stream is rebuilt, 0 if the watchdog is disabled.
+    std::atomic<int64_t> callbackTimestamp{}; //!< The time at which the data callback was last invoked, or at which the stream was last started if it hasn't been since.
+    uint64_t stallRecoveries{}; //!< The amount of times the stream has been rebuilt after stalling.
+    int64_t transitionTimeout{}; //!< The time in nanoseconds that a state transition of the stream is given, 0 if it's derived from the buffer of the stream.
+    uint64_t deadlineRecoveries{}; //!< The amount of times the stream has been rebuilt after a transition or a drain missed its deadline.
+    bool serviceAcquired{}; //!< If this instance is keeping the service thread alive, it's acquired by the first prepare. This is protected by the mutex.
+
+    std::string duplexGroup; //!< The name of the duplex pair this instance belongs to, this is protected by instancesMutex.
+    OboePcm* duplexPartner{}; //!< The instance of the opposite direction in the duplex pair, if any. Modifications require instancesMutex and the mutexes of both instances.
+                              //!< The mutex of the capture instance of a pair must be locked prior to that of the playback instance.
+    std::atomic<OboePcm*> duplexInput{}; //!< The capture instance whose input is read by the data callback of this playback instance, null if none is attached.
+    std::atomic<bool> duplexPumping{}; //!< If the data callback is reading the attached input, this is used to wait on it when detaching.
+    bool streamPaired{}; //!< If the stream was opened for the input of a duplex pair, it has no data callback of its own in that case. This is protected by the mutex.
+    constexpr static size_t InputBlockFrames{256}; //!< The amount of frames that are read from a paired input stream at once.
+    std::unique_ptr<uint8_t[]> inputBlock; //!< Receives frames read from a paired input stream before they're written into the ring.
+    std::atomic<uint64_t> driftDrops{}; //!< The amount of frames of a paired input that were discarded to keep its latency bounded.
+
+    /**
+     * @brief A state change that is applied by the data callback at the start of a burst, this makes transitions sample-accurate without blocking on the stream.
+     */
+    struct Command {
+        enum class Type : uint8_t {
+            Start, //!< Starts consuming the ring, fading in over the supplied amount of frames.
+            Stop, //!< Stops consuming the ring once the supplied position has been reached, or after the supplied amount of frames if it's 0. The frames are limited to those queued in the ring.
+            Fade, //!< Ramps the gain to the supplied value over the supplied amount of frames.
+            Flush, //!< Discards all frames in the ring.
+            Drain, //!< Stops consuming the ring at the supplied position and signals the drain with the supplied serial once that position has been presented.
+        } type;
+        uint64_t position;
+        float gain;
+        uint32_t frames;
+        uint32_t serial;
+    };
+    SpscQueue<Command, 16> commands; //!< Commands for the data callback, these are pushed with the mutex held.
+    std::atomic<bool> startFailed{}; //!< If the stream failed to start after ALSA was told the PCM started or a stalled stream couldn't be rebuilt, Pointer reports this as an xrun until the PCM is prepared again.
+    bool running{}; //!< If the ring has been started as far as the application is concerned, the stream itself keeps running for the idle timeout after it's stopped. This is protected by the mutex.
+    int64_t idleTimestamp{}; //!< The time at which the ring was last stopped, this is protected by the mutex.
+    int64_t idleTimeout{}; //!< The time in nanoseconds after which the service thread stops a stream that isn't consuming the ring, 0 if it's stopped right away.
+    std::atomic<bool> ringActive{}; //!< If the ring was being consumed or filled as of the last time that commands were applied, the service thread keeps the stream running until it isn't.
+    bool reopenWanted{}; //!< If the stream stalled or failed to stop, the service thread then replaces it. This is protected by the mutex.
+    int64_t reopenTimestamp{}; //!< The time at which replacing the stream last failed, it's only retried after the transition timeout. This is protected by the mutex.
+    uint64_t prepareGeneration{}; //!< Incremented by every prepare, so that the service thread discards a stream that it opened with outdated hardware parameters. This is protected by the mutex.
+    constexpr static unsigned int PauseFadeMilliseconds{5}; //!< The length of the fades when pausing and resuming, this avoids clicks from cutting off the audio.
+
+    // The state below is only accessed with renderLock held, this is the data callback unless another thread needs to apply commands directly.
+    RenderLock renderLock;
+    bool consuming{}; //!< If frames are being consumed from the ring.
+    uint64_t stopPosition{UINT64_MAX}; //!< The position in the ring at which to stop consuming.
+    float gain{1.0f}; //!< The gain that's applied to the frames of the ring.
+    float gainStep{}; //!< The amount the gain changes by every frame while fading.
+    uint32_t fadeFrames{}; //!< The amount of frames until the current fade completes.
+    bool drainRequested{}; //!< If the end marker of a drain is placed once the stop position is reached.
+    uint32_t drainSerial{}; //!< The serial of the drain that's in progress.
+    int64_t drainMarker{-1}; //!< The position in the stream that follows the last frame of the drained ring, -1 if none is pending.
+    constexpr static int64_t DrainMarkerAtEnd{-2}; //!< The marker follows the frames that have been handed to the stream so far, it's resolved by the data callback.
+    std::atomic<uint32_t> drainCompleted{}; //!< The serial of the last drain whose end marker has been presented.
+    uint32_t drainsIssued{}; //!< The amount of drains that have been issued, this is the serial of the latest drain. This is protected by the mutex.
+    bool draining{}; //!< If the latest drain is in progress, it's abandoned when the ring is stopped. This is protected by the mutex.
+    bool drained{}; //!< If the latest drain completed, the stop that ALSA issues after it only ends this instance rather than its link group. This is protected by the mutex.
+    int64_t drainTimeout{}; //!< The time in nanoseconds that the latest drain was given to complete, this is protected by the mutex.
+    int64_t drainStart{}; //!< The time at which the latest drain was issued, this is protected by the mutex.
+    std::atomic<int64_t> drainDeadline{}; //!< The time by which the latest drain has to complete.
+    std::atomic<uint32_t> pendingDrainSerial{}; //!< The serial of a non-blocking drain that the application is polling for the completion of, 0 if there's none.
+    constexpr static int DrainSliceMilliseconds{50}; //!< The interval at which Drain checks on the stream while waiting on its end marker, such as for stalls.
+
+    /**
+     * @return The amount of frames that can currently be written into the ring, or read from it when capturing.
+     */
+    snd_pcm_uframes_t GetAvail() const {
+        // Note: These are sequentially consistent to pair with the data callback, see Render for details.
+        if (capture)
+            return hwPosition.load() - applPosition.load();
+        return ringFrames - (applPosition.load() - hwPosition.load());
+    }
+
+    /**
+     * @brief Wakes up any pollers of the PCM, this is safe to call from the data callback.
+     */
+    void Notify() {
+        eventfd_write(eventFd, 1);
+    }
+
+    /**
+     * @brief Records frames starting at the supplied position in the ring into the application tap, this must be called with the mutex held.
+     */
+    void TapRing(uint64_t position, size_t frames) {
+        if (!applicationTap)
+            return;
+        size_t offset{position % ringFrames}, firstFrames{std::min<size_t>(frames, ringFrames - offset)};
+        applicationTap->Write(ring.get() + offset * frameSize, firstFrames * frameSize);
+        applicationTap->Write(ring.get(), (frames - firstFrames) * frameSize);
+    }
+
+    /**
+     * @brief Copies contiguous frames from the ring into the buffer of the stream, converting them to its channel layout if required.
+     */
+    void CopyFrames(const uint8_t* input, uint8_t* output, size_t frames) {
+        if (kernels.copy)
+            kernels.copy(input, output, frames, meter.GetAccumulator());
+        else
+            kernels.mix(input, reinterpret_cast<float*>(output), frames, mixer->GetMatrix(), meter.GetAccumulator());
+        meter.Commit(frames);
+    }
+
+    /**
+     * @brief Copies frames starting at the supplied position from the ring into the buffer of the stream.
+     */
+    void ReadRing(uint64_t position, uint8_t* output, size_t frames) {
+        size_t offset{position % ringFrames}, firstFrames{std::min<size_t>(frames, ringFrames - offset)};
+        CopyFrames(ring.get() + offset * frameSize, output, firstFrames);
+        CopyFrames(ring.get(), output + firstFrames * outputFrameSize, frames - firstFrames);
+    }
+
+    /**
+     * @brief Fills the buffer of the stream with frames resampled from the ring starting at the supplied position, this is only called by the data callback.
+     * @param available The amount of frames from the ring that may be consumed.
+     * @return The amount of frames from the ring that have been fed into the resampler, the remainder of the buffer is filled with silence if they ran out.
+     */
+    size_t ResampleRing(uint64_t position, uint64_t available, float* output, size_t frames, bool& exhausted) {
+        unsigned int channels{deviceChannels};
+        size_t consumed{};
+        for (size_t frame{}; frame < frames; frame++) {
+            while (resampler->isWriteNeeded()) {
+                if (resampleBlockOffset == resampleBlockFrames) {
+                    // The block is only refilled once it's empty, so the next frame in the ring directly follows the ones that have been consumed.
+                    size_t count{static_cast<size_t>(std::min<uint64_t>(available - consumed, ResampleBlockFrames))};
+                    if (!count) {
+                        std::fill(output + frame * channels, output + frames * channels, 0.0f);
+                        exhausted = true;
+                        return consumed;
+                    }
+                    ReadRing(position + consumed, reinterpret_cast<uint8_t*>(resampleBlock.data()), count);
+                    resampleBlockOffset = 0;
+                    resampleBlockFrames = count;
+                }
+
+                resampler->writeNextFrame(&resampleBlock[resampleBlockOffset++ * channels]);
+                consumed++;
+            }
+            resampler->readNextFrame(output + frame * channels);
+        }
+        return consumed;
+    }
+
+    /**
+     * @return An estimate of the CLOCK_MONOTONIC time in nanoseconds at which the frame at the supplied position will be presented by the device.
+     */
+    static int64_t EstimatePresentationTime(oboe::AudioStream* audioStream, const oboe::ResultWithValue<oboe::FrameTimestamp>& timestamp, int64_t position) {
+        int64_t rate{audioStream->getSampleRate()};
+        if (timestamp)
+            return timestamp.value().timestamp + (position - timestamp.value().position) * oboe::kNanosPerSecond / rate;
+
+        // The timestamp is commonly unavailable until the stream has been running for a bit, we assume that all frames queued in Oboe will be played first.
+        return GetMonotonicNanoseconds() + (position - audioStream->getFramesRead()) * oboe::kNanosPerSecond / rate;
+    }
+
+    /**
+     * @brief Signals the drain in progress once its end marker has been presented by the device, this is only called by the data callback.
+     * @note This is checked on every burst, so a drain completes within a burst of the last frame being presented rather than once the device has merely consumed it.
+     */
+    void CheckDrainMarker(oboe::AudioStream* audioStream, const oboe::ResultWithValue<oboe::FrameTimestamp>& timestamp) {
+        if (drainMarker == DrainMarkerAtEnd)
+            drainMarker = audioStream->getFramesWritten();
+        if (drainMarker < 0 || EstimatePresentationTime(audioStream, timestamp, drainMarker) > GetMonotonicNanoseconds())
+            return;
+
+        drainMarker = -1;
+        drainCompleted.store(drainSerial, std::memory_order_release);
+        eventfd_write(drainEventFd, 1);
+        Notify(); // Applications polling a non-blocking drain are woken up through the poll descriptor.
+    }
+
+    /**
+     * @brief Applies all pending commands, this must be called with renderLock held.
+     */
+    void ApplyCommands() {
+        Command command;
+        while (commands.Pop(command)) {
+            uint64_t hw{hwPosition.load(std::memory_order_relaxed)};
+            switch (command.type) {
+                case Command::Type::Start:
+                    consuming = true;
+                    stopPosition = UINT64_MAX;
+                    drainRequested = false;
+                    drainMarker = -1;
+                    gain = command.frames ? 0.0f : 1.0f;
+                    gainStep = command.frames ? 1.0f / static_cast<float>(command.frames) : 0.0f;
+                    fadeFrames = command.frames;
+                    break;
+
+                case Command::Type::Stop:
+                    stopPosition = command.position ? std::max(command.position, hw) : std::min(hw + command.frames, applPosition.load(std::memory_order_acquire));
+                    if (stopPosition == hw)
+                        consuming = false;
+                    break;
+
+                case Command::Type::Fade:
+                    gainStep = command.frames ? (command.gain - gain) / static_cast<float>(command.frames) : 0.0f;
+                    fadeFrames = command.frames;
+                    if (!command.frames)
+                        gain = command.gain;
+                    break;
+
+                case Command::Type::Flush:
+                    hwPosition.store(applPosition.load(std::memory_order_acquire));
+                    resampleBlockOffset = resampleBlockFrames = 0;
+                    drainRequested = false;
+                    drainMarker = -1;
+                    break;
+
+                case Command::Type::Drain:
+                    stopPosition = std::max(command.position, hw);
+                    drainSerial = command.serial;
+                    drainRequested = consuming && stopPosition != hw;
+                    drainMarker = drainRequested ? -1 : DrainMarkerAtEnd;
+                    if (stopPosition == hw)
+                        consuming = false;
+                    break;
+            }
+        }
+        ringActive.store(consuming, std::memory_order_relaxed);
+    }
+
+    /**
+     * @return An estimate of the CLOCK_MONOTONIC time in nanoseconds at which the frame at the supplied position was captured by the device.
+     */
+    static int64_t EstimateCaptureTime(oboe::AudioStream* audioStream, int64_t position) {
+        int64_t rate{audioStream->getSampleRate()};
+        auto timestamp{audioStream->getTimestamp(CLOCK_MONOTONIC)};
+        if (timestamp)
+            return timestamp.value().timestamp + (position - timestamp.value().position) * oboe::kNanosPerSecond / rate;
+
+        // Without a timestamp, we assume that the newest frame in the stream has only just been captured.
+        return GetMonotonicNanoseconds() - (audioStream->getFramesWritten() - position) * oboe::kNanosPerSecond / rate;
+    }
+
+    /**
+     * @brief Writes captured frames into the ring and wakes up the application as required, this is only called by whichever thread is applying commands.
+     * @param captureTimestamp The CLOCK_MONOTONIC time at which the first of the frames was captured.
+     * @note This never blocks, frames that don't fit into the ring are dropped and accounted for as an overrun.
+     */
+    void WriteInput(const uint8_t* input, size_t frames, int32_t burstFrames, int64_t captureTimestamp) {
+        uint64_t hw{hwPosition.load(std::memory_order_relaxed)};
+        if (overrunPending.load(std::memory_order_relaxed))
+            return; // The ring stays as it was at the time of the overrun until the application recovers from the xrun.
+
+        size_t space{static_cast<size_t>(ringFrames - (hw - applPosition.load(std::memory_order_acquire)))};
+        if (frames > space) {
+            // The newest input is dropped rather than overwriting the ring, the application may be reading from it concurrently.
+            overruns.fetch_add(1, std::memory_order_relaxed);
+            overrunFrames.fetch_add(frames - space, std::memory_order_relaxed);
+            if (overrunXrun) {
+                overrunPending.store(true, std::memory_order_release);
+                Notify(); // Pollers need to be woken up to observe the xrun from Pointer, even if the ring didn't cross any wakeup condition.
+                return;
+            }
+            frames = space;
+        }
+
+        // The capture time of every period that begins within these frames is recorded, so reads can be timestamped without a round trip into the stream.
+        snd_pcm_uframes_t periodSize{plug.period_size};
+        for (uint64_t period{(hw + periodSize - 1) / periodSize}; period * periodSize < hw + frames; period++)
+            periodTimestamps[period % periodCount].store(captureTimestamp + static_cast<int64_t>(period * periodSize - hw) * oboe::kNanosPerSecond / plug.rate, std::memory_order_relaxed);
+
+        size_t offset{hw % ringFrames}, firstFrames{std::min<size_t>(frames, ringFrames - offset)};
+        kernels.copy(input, ring.get() + offset * frameSize, firstFrames, meter.GetAccumulator());
+        kernels.copy(input + firstFrames * frameSize, ring.get(), frames - firstFrames, meter.GetAccumulator());
+        meter.Commit(frames);
+        hwPosition.store(hw + frames);
+
+        // The device delay of a capture is the input that has been captured since the snapshot, this is at most a burst.
+        status.Publish({.hwPosition = hw + frames, .deviceDelay = burstFrames, .timestamp = GetMonotonicNanoseconds()});
+
+        if (frames) {
+            // This mirrors the wakeup conditions of playback, see Render for details on the ordering.
+            int64_t avail{static_cast<int64_t>(hw + frames - applPosition.load())}, minimum{static_cast<int64_t>(availMin)};
+            bool availCrossed{avail >= minimum && avail - static_cast<int64_t>(frames) < minimum};
+
+            bool periodCrossed{periodEvent && (hw + frames) / periodSize != hw / periodSize};
+            if (periodCrossed)
+                periodEventPending.store(true, std::memory_order_release);
+
+            if (availCrossed || periodCrossed)
+                Notify();
+        }
+    }
+
+    /**
+     * @brief Reads the input of a duplex pair from its stream into the ring, this is called by the data callback of the playback instance of the pair.
+     * @param numFrames The amount of frames that the output consumes in this callback, the input is expected to produce as many.
+     */
+    void PumpInput(int32_t numFrames) {
+        callbackTimestamp.store(GetMonotonicNanoseconds(), std::memory_order_relaxed);
+        std::unique_lock render{renderLock, std::try_to_lock};
+        if (!render.owns_lock())
+            return; // The input is left in its stream, anything beyond the slack is discarded by the next callback.
+        ApplyCommands();
+
+        // The input and the output are driven by separate clocks that drift apart, any input that piles up beyond this callback and a burst of slack is discarded.
+        // This bounds the round trip latency of the pair rather than letting it grow for as long as the streams run. All input is discarded while the ring is stopped.
+        int32_t burstFrames{stream->getFramesPerBurst()};
+        int64_t wanted{consuming ? numFrames : 0}, excess{};
+        auto available{stream->getAvailableFrames()};
+        if (available)
+            excess = std::max<int64_t>(available.value() - wanted - (consuming ? burstFrames : 0), 0);
+
+        // The oldest frames are the ones that are discarded, they're read first.
+        int64_t remaining{wanted + excess};
+        while (remaining > 0) {
+            int64_t position{stream->getFramesRead()};
+            auto result{stream->read(inputBlock.get(), static_cast<int32_t>(std::min<int64_t>(remaining, InputBlockFrames)), 0)};
+            if (!result || result.value() == 0)
+                break; // The input is behind the output, the ring just receives fewer frames for this callback.
+
+            int64_t frames{result.value()}, dropped{std::min(frames, excess)};
+            excess -= dropped;
+            driftDrops.fetch_add(static_cast<uint64_t>(dropped), std::memory_order_relaxed);
+            if (frames > dropped)
+                WriteInput(inputBlock.get() + dropped * frameSize, static_cast<size_t>(frames - dropped), burstFrames, EstimateCaptureTime(stream.get(), position + dropped));
+            remaining -= frames;
+        }
+    }
+
+    /**
+     * @brief The data callback of the stream, this is invoked through its StreamCallback for as long as the stream belongs to this instance.
+     */
+    oboe::DataCallbackResult Render(oboe::AudioStream* audioStream, void* audioData, int32_t numFrames) {
+        auto* output{static_cast<uint8_t*>(audioData)};
+        callbackTimestamp.store(GetMonotonicNanoseconds(), std::memory_order_relaxed);
+
+        // Another thread is applying commands or resetting the ring, we don't wait on it and simply skip this burst. Captured input is dropped in that case.
+        std::unique_lock render{renderLock, std::try_to_lock};
+        if (!render.owns_lock()) {
+            if (!capture)
+                std::memset(audioData, 0, static_cast<size_t>(numFrames) * audioStream->getBytesPerFrame());
+            return oboe::DataCallbackResult::Continue;
+        }
+
+        if (capture) {
+            ApplyCommands();
+            if (consuming)
+                WriteInput(static_cast<const uint8_t*>(audioData), static_cast<size_t>(numFrames), numFrames, EstimateCaptureTime(audioStream, audioStream->getFramesRead()));
+            return oboe::DataCallbackResult::Continue;
+        }
+
+        // The input of a duplex pair is read prior to producing the output, so an application processing the input immediately sees it within the same burst.
+        // This is sequentially consistent to pair with DetachInput, either it observes the input being detached or it waits for us to finish with it.
+        duplexPumping.store(true);
+        if (OboePcm* input{duplexInput.load()})
+            input->PumpInput(numFrames);
+        duplexPumping.store(false);
+
+        ApplyCommands();
+        if (!consuming) {
+            // The stream keeps running until the service thread stops it, or for the idle timeout so that it can be restarted without a round trip to the device, it just plays silence.
+            // Note: Nothing but the commands and the drain marker is touched in this state, this allows the configuration of the PCM to change while the stream is running.
+            std::memset(audioData, 0, static_cast<size_t>(numFrames) * audioStream->getBytesPerFrame());
+            if (drainMarker != -1)
+                CheckDrainMarker(audioStream, audioStream->getTimestamp(CLOCK_MONOTONIC));
+            return oboe::DataCallbackResult::Continue;
+        }
+
+        // Note: Oboe only accounts for the frames of a callback after it returns, so this is the position of the first frame we're producing.
+        int64_t framesWritten{audioStream->getFramesWritten()};
+        auto timestamp{audioStream->getTimestamp(CLOCK_MONOTONIC)};
+        if (drainMarker != -1)
+            CheckDrainMarker(audioStream, timestamp);
+
+        // A scheduled start holds off the ring with silence until the frame that'll be presented at the target time.
+        // The padding is recalculated on every callback until the target is reached as the estimate gets more accurate once the stream is running.
+        int64_t padFrames{prefillFrames.load(std::memory_order_acquire)};
+        if (padFrames)
+            prefillFrames.store(std::max<int64_t>(padFrames - numFrames, 0), std::memory_order_relaxed);
+
+        int64_t target{startTarget.load(std::memory_order_acquire)};
+        if (target) {
+            int64_t presentation{EstimatePresentationTime(audioStream, timestamp, framesWritten)};
+            padFrames = std::max<int64_t>((target - presentation) * audioStream->getSampleRate() / oboe::kNanosPerSecond, padFrames);
+            if (padFrames < numFrames) {
+                triggerTimestamp.store(presentation + padFrames * oboe::kNanosPerSecond / audioStream->getSampleRate(), std::memory_order_relaxed);
+                startTarget.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        size_t silenceFrames{static_cast<size_t>(std::min<int64_t>(padFrames, numFrames))};
+        std::memset(output, 0, silenceFrames * outputFrameSize);
+        output += silenceFrames * outputFrameSize;
+
+        // The ring is consumed up to the stop position at most, running out of frames before that is an underrun.
+        uint64_t hw{hwPosition.load(std::memory_order_relaxed)}, frames;
+        uint64_t queued{applPosition.load(std::memory_order_acquire) - hw}, available{std::min(queued, stopPosition - hw)};
+        size_t outputFrames{numFrames - silenceFrames};
+        bool exhausted{};
+        if (resampler) {
+            frames = ResampleRing(hw, available, reinterpret_cast<float*>(output), outputFrames, exhausted);
+        } else {
+            frames = std::min<uint64_t>(available, outputFrames);
+            ReadRing(hw, output, frames);
+
+            // If the application hasn't written enough samples then we pad the remainder with silence, Oboe will keep calling us regardless.
+            std::memset(output + frames * outputFrameSize, 0, (outputFrames - frames) * outputFrameSize);
+            exhausted = frames < outputFrames;
+        }
+        if (exhausted && available == queued)
+            underruns.fetch_add(1, std::memory_order_relaxed);
+
+        if (fadeFrames || gain != 1.0f) {
+            size_t fadingFrames{std::min<size_t>(fadeFrames, outputFrames)};
+            kernels.gain(output, fadingFrames, deviceChannels, gain, gainStep);
+            kernels.gain(output + fadingFrames * outputFrameSize, outputFrames - fadingFrames, deviceChannels, gain, 0.0f);
+            fadeFrames -= static_cast<uint32_t>(fadingFrames);
+            if (!fadeFrames)
+                gain = std::round(gain * 1000.0f) / 1000.0f; // Avoids the accumulated error of the steps leaving the gain marginally off its target.
+        }
+
+        if (deviceTap)
+            deviceTap->Write(static_cast<const uint8_t*>(audioData), static_cast<size_t>(numFrames) * outputFrameSize);
+
+        hwPosition.store(hw + frames);
+        if (hw + frames >= stopPosition) {
+            consuming = false;
+            ringActive.store(false, std::memory_order_relaxed);
+            if (drainRequested) {
+                // The end marker follows the last frame of the ring in the stream, it's presented once the device has played everything up to it.
+                // A resampler emits the last frames over the whole burst, so the marker is conservatively placed at the end of it in that case.
+                drainMarker = framesWritten + static_cast<int64_t>(silenceFrames + (resampler ? outputFrames : frames));
+                drainRequested = false;
+            }
+        }
+
+        // The device delay is derived from the presentation timestamp when it's available, the frames handed to Oboe include the current callback.
+        // Any padding for a scheduled start that's still outstanding after this callback will also be played before the ring.
+        StatusPage::Status snapshot{.hwPosition = hw + frames};
+        snapshot.deviceDelay = framesWritten + numFrames + std::max<int64_t>(padFrames - numFrames, 0);
+        if (timestamp) {
+            snapshot.deviceDelay -= timestamp.value().position;
+            snapshot.timestamp = timestamp.value().timestamp;
+        } else {
+            snapshot.deviceDelay -= audioStream->getFramesRead();
+            snapshot.timestamp = GetMonotonicNanoseconds();
+        }
+        if (resampler)
+            snapshot.deviceDelay = snapshot.deviceDelay * plug.rate / streamRate; // The delay is reported in frames of the application.
+        status.Publish(snapshot);
+
+        if (frames) {
+            // We only wake up the application when a wakeup condition is crossed by this callback, rather than after every callback.
+            // This relies on PollRevents keeping the eventfd signalled for as long as the condition holds (level-triggered).
+            // The position store above and the load below are sequentially consistent, this guarantees that either we observe a concurrent write into the ring
+            // or the poller that follows the write observes our updated position, so the transition can't be missed by both sides.
+            int64_t remaining{static_cast<int64_t>(applPosition.load() - hw)}, capacity{static_cast<int64_t>(ringFrames)}, minimum{static_cast<int64_t>(availMin)};
+            bool availCrossed{capacity - remaining < minimum && capacity - remaining + static_cast<int64_t>(frames) >= minimum};
+
+            // Period boundaries are detected based on the frames consumed by the device, exactly like the DMA position of a hardware PCM.
+            snd_pcm_uframes_t periodSize{plug.period_size};
+            bool periodCrossed{periodEvent && (hw + frames) / periodSize != hw / periodSize};
+            if (periodCrossed)
+                periodEventPending.store(true, std::memory_order_release);
+
+            if (availCrossed || periodCrossed)
+                Notify();
+        }
+
+        return oboe::DataCallbackResult::Continue;
+    }
+
+    /**
+     * @return The time in nanoseconds that a state transition of the stream is given to settle, this must be called with the mutex held.
+     */
+    int64_t GetTransitionTimeout() {
+        if (transitionTimeout)
+            return transitionTimeout;
+        int64_t bufferDuration{static_cast<int64_t>(stream->getBufferCapacityInFrames()) * oboe::kNanosPerSecond / stream->getSampleRate()};
+        return std::max(MinimumTransitionTimeoutNanoseconds, bufferDuration * TransitionTimeoutBuffers);
+    }
 
-        oboe::Result result{self->stream->requestStart()};
-        if (result != oboe::Result::OK) {
-            std::cerr << "[ALSA Oboe] Failed to start stream: " << oboe::convertToText(result) << std::endl;
-            return -1;
-        }
+    /**
+     * @brief Waits for a stream to settle into a state, this is only called by the service thread without any mutex held as it blocks on the device.
+     * @param deadline The time at which the wait is abandoned.
+     * @return 0 once the state is reached, -ETIMEDOUT if the deadline passed or -1 if the stream failed.
+     */
+    static int WaitForState(oboe::AudioStream& audioStream, oboe::StreamState target, int64_t deadline) {
+        oboe::StreamState state{audioStream.getState()};
+        while (state != target) {
+            int64_t remaining{deadline - GetMonotonicNanoseconds()};
+            if (remaining <= 0)
+                return -ETIMEDOUT;
 
+            oboe::Result result{audioStream.waitForStateChange(state, &state, std::min(remaining, WaitSliceNanoseconds))};
+            if (result == oboe::Result::ErrorTimeout) {
+                state = audioStream.getState(); // The state may have changed without waking us up, it's re-read rather than trusting the wait.
+                continue;
+            }
+            if (result != oboe::Result::OK) {
+                std::cerr << "[ALSA Oboe] Failed to wait for " << oboe::convertToText(target) << ": " << oboe::convertToText(result) << std::endl;
+                return -1;
+            }
+        }
         return 0;
     }
 
-    static int Stop(snd_pcm_ioplug_t* ext) {
-        auto* self{static_cast<OboePcm*>(ext->private_data)};
-        std::scoped_lock lock{self->mutex};
-        if (!self->stream)
-            return -EBADFD;
-
-        oboe::StreamState state{self->stream->getState()};
+    /**
+     * @brief Pauses and flushes a stream, this is only called by the service thread without any mutex held as it blocks on the device.
+     * @note Input streams can't be paused, they're stopped instead which discards any input that hasn't been read.
+     * @return 0 once the stream has stopped, -ETIMEDOUT if it didn't by the deadline or -1 if it failed to.
+     */
+    static int StopStream(oboe::AudioStream& audioStream, int64_t deadline) {
+        oboe::StreamState state{audioStream.getState()};
         if (state == oboe::StreamState::Stopped || state == oboe::StreamState::Flushed)
             return 0; // We don't need to do anything if the stream is already stopped.
 
-        oboe::Result result{self->stream->requestPause()};
-        if (result != oboe::Result::OK) {
-            std::cerr << "[ALSA Oboe] Failed to pause stream: " << oboe::convertToText(result) << std::endl;
-            return -1;
-        }
+        int err{};
+        oboe::Result result;
+        if (audioStream.getDirection() == oboe::Direction::Input) {
+            result = audioStream.requestStop();
+            if (result != oboe::Result::OK) {
+                std::cerr << "[ALSA Oboe] Failed to stop stream: " << oboe::convertToText(result) << std::endl;
+                err = -1;
+            }
+            if (!err)
+                err = WaitForState(audioStream, oboe::StreamState::Stopped, deadline);
+        } else {
+            result = audioStream.requestPause();
+            if (result != oboe::Result::OK) {
+                std::cerr << "[ALSA Oboe] Failed to pause stream: " << oboe::convertToText(result) << std::endl;
+                err = -1;
+            }
 
-        state = self->stream->getState();
-        while (state != oboe::StreamState::Paused) {
             // AAudio documentation states that requestFlush() is valid while the stream is Pausing.
             // However, in practice it returns InvalidState, so we'll just wait for the stream to pause.
-            result = self->stream->waitForStateChange(state, &state, TimeoutNanoseconds);
+            if (!err)
+                err = WaitForState(audioStream, oboe::StreamState::Paused, deadline);
+
+            if (!err) {
+                result = audioStream.requestFlush();
+                if (result != oboe::Result::OK) {
+                    std::cerr << "[ALSA Oboe] Failed to flush stream: " << oboe::convertToText(result) << std::endl;
+                    err = -1;
+                }
+            }
+            if (!err)
+                err = WaitForState(audioStream, oboe::StreamState::Flushed, deadline);
+        }
+        return err;
+    }
+
+    /**
+     * @brief Queues a command for the data callback, this must be called with the mutex held.
+     */
+    void PushCommand(const Command& command) {
+        // The queue can only fill up if the data callback hasn't run in a while, in which case we apply the commands ourselves to make space.
+        if (!commands.Push(command)) {
+            SyncCommands();
+            commands.Push(command);
+        }
+    }
+
+    /**
+     * @brief Applies all pushed commands directly rather than leaving them to the data callback, this must be called with the mutex held.
+     * @note This only waits for a data callback that's in progress to return, never on the stream itself.
+     */
+    void SyncCommands() {
+        std::scoped_lock render{renderLock};
+        ApplyCommands();
+    }
+
+    /**
+     * @brief Starts consuming the ring while applying any scheduled start time, the service thread starts the stream if it isn't running. This must be called with the mutex held.
+     * @param resume If the ring is resumed after a pause, it's faded back in rather than being held off by the prefill or a scheduled start.
+     */
+    oboe::Result StartRing(bool resume = false) {
+        uint32_t fadeInFrames{};
+        if (resume) {
+            // The frames that follow a pause were already queued behind audio that has been played, so no silence is inserted ahead of them.
+            fadeInFrames = capture ? 0U : static_cast<uint32_t>(streamRate * PauseFadeMilliseconds / 1000);
+            triggerTimestamp.store(GetMonotonicNanoseconds(), std::memory_order_relaxed);
+        } else if (capture) {
+            // Captured frames aren't presented, so a scheduled start can't be honoured and the ring simply starts filling with the next input.
+            scheduledStart = 0;
+            triggerTimestamp.store(GetMonotonicNanoseconds(), std::memory_order_relaxed);
+        } else if (scheduledStart) {
+            // The trigger timestamp is updated with the achieved time by the data callback once it stops padding.
+            triggerTimestamp.store(scheduledStart, std::memory_order_relaxed);
+            startTarget.store(scheduledStart, std::memory_order_release);
+            scheduledStart = 0;
+        } else {
+            triggerTimestamp.store(GetMonotonicNanoseconds(), std::memory_order_relaxed);
+
+            // The first callback commonly occurs before the application has queued enough frames to fill it, so we hold off the ring with whole bursts of silence.
+            // Scheduled starts already pad the start of the stream with silence, so this is only done for immediate starts.
+            prefillFrames.store(static_cast<int64_t>(prefillBursts) * stream->getFramesPerBurst(), std::memory_order_release);
+        }
+
+        PushCommand({.type = Command::Type::Start, .frames = fadeInFrames});
+        running = true;
+        startDeferred = false;
+        if (streamPaired && AttachInput() < 0) {
+            running = false; // The start can be retried, the Start command that was pushed is simply repeated.
+            return oboe::Result::ErrorInvalidState;
+        }
+
+        // Starting the stream blocks on the device, so it's left to the service thread. The data callback applies the Start command once it runs.
+        WakeService();
+        return oboe::Result::OK;
+    }
+
+    /**
+     * @brief Has the data callback of the playback instance of the duplex pair read the input of this instance, the service thread keeps its stream running while it does.
+     * @note This must be called with the mutex held, the mutex of the partner is locked by this.
+     */
+    int AttachInput() {
+        OboePcm* partner{duplexPartner};
+        if (!partner)
+            return -ENODEV;
+
+        std::scoped_lock lock{partner->mutex};
+        if (!partner->stream) {
+            std::cerr << "[ALSA Oboe] Duplex input can't start before its output has been prepared" << std::endl;
+            return -EBADFD;
+        }
+
+        // The output plays silence while its own ring isn't running, the idle timeout doesn't apply to it while the input is attached.
+        partner->duplexInput.store(this);
+        return 0;
+    }
+
+    /**
+     * @brief Stops the data callback of the playback instance of the duplex pair from reading the input of this instance, this must be called with the mutex held.
+     * @note This waits for the data callback to finish with the input, so the stream and ring can be modified afterwards.
+     */
+    void DetachInput() {
+        OboePcm* partner{duplexPartner};
+        if (!partner || partner->duplexInput.load() != this)
+            return;
+
+        partner->duplexInput.store(nullptr);
+        while (partner->duplexPumping.load())
+            std::this_thread::yield();
+    }
+
+    /**
+     * @brief Stops consuming the ring, the service thread then stops the stream once it has been idle for the idle timeout. This must be called with the mutex held.
+     * @param flush If all frames in the ring should be discarded.
+     * @param fadeOut If the audio is faded out over PauseFadeMilliseconds before stopping, rather than being cut off.
+     */
+    void StopRing(bool flush, bool fadeOut = false) {
+        uint32_t fadeOutFrames{};
+        if (fadeOut) {
+            // The gain is ramped in frames of the stream while the ring is consumed in frames of the application, these only differ when resampling.
+            PushCommand({.type = Command::Type::Fade, .gain = 0.0f, .frames = static_cast<uint32_t>(streamRate * PauseFadeMilliseconds / 1000)});
+            fadeOutFrames = static_cast<uint32_t>(plug.rate * PauseFadeMilliseconds / 1000);
+        }
+        PushCommand({.type = Command::Type::Stop, .frames = fadeOutFrames});
+        if (flush)
+            PushCommand({.type = Command::Type::Flush});
+        running = false;
+        startDeferred = false;
+        draining = false; // Any drain in progress is abandoned, the commands above cancel its end marker.
+        pendingDrainSerial.store(0, std::memory_order_relaxed);
+        idleTimestamp = GetMonotonicNanoseconds();
+        WakeService();
+    }
+
+    /**
+     * @return An estimate of the time in nanoseconds between starting the stream and its first frame being presented, this must be called with the mutex held.
+     */
+    int64_t EstimateStartLatency() {
+        if (!stream)
+            return 0;
+        return static_cast<int64_t>(stream->getBufferSizeInFrames() + stream->getFramesPerBurst()) * oboe::kNanosPerSecond / stream->getSampleRate();
+    }
+
+    /**
+     * @brief Starts all prepared members of a group so that their first frames are presented at the same time.
+     * @param initiator The member that ALSA is starting, the ALSA state of all other members is transitioned to running by us.
+     * @note This must be called without the mutex of any member held.
+     */
+    static int StartLinked(LinkGroup& group, OboePcm* initiator) {
+        std::scoped_lock groupLock{group.mutex};
+
+        // Streams take a varying amount of time to present their first frame, so all members are scheduled to start at the time the slowest one can.
+        // An explicitly scheduled start on any member pushes back the start of the entire group.
+        int64_t now{GetMonotonicNanoseconds()}, target{now};
+        for (OboePcm* member : group.members) {
+            std::scoped_lock lock{member->mutex};
+            if (member->stream && !member->running)
+                target = std::max({target, now + member->EstimateStartLatency(), member->scheduledStart});
+        }
+
+        int err{};
+        for (OboePcm* member : group.members) {
+            std::scoped_lock lock{member->mutex};
+            if (!member->stream || member->running)
+                continue; // Members that haven't been prepared yet aren't started, they'll start on their own later.
+
+            member->scheduledStart = target;
+            oboe::Result result{member->StartRing()};
             if (result != oboe::Result::OK) {
-                std::cerr << "[ALSA Oboe] Failed to wait for pause: " << oboe::convertToText(result) << std::endl;
-                return -1;
+                std::cerr << "[ALSA Oboe] Failed to start linked stream: " << oboe::convertToText(result) << std::endl;
+                err = -1;
+                continue;
+            }
+
+            if (member != initiator)
+                member->linkedState.store(SND_PCM_STATE_RUNNING, std::memory_order_release);
+        }
+
+        return err;
+    }
+
+    /**
+     * @brief Stops all members of a group, this is the counterpart to StartLinked.
+     */
+    static void StopLinked(LinkGroup& group, OboePcm* initiator) {
+        std::scoped_lock groupLock{group.mutex};
+
+        for (OboePcm* member : group.members) {
+            std::scoped_lock lock{member->mutex};
+            if (!member->stream)
+                continue;
+
+            member->StopRing(true);
+            if (member != initiator)
+                member->linkedState.store(SND_PCM_STATE_SETUP, std::memory_order_release);
+        }
+    }
+
+    /**
+     * @brief Applies a state transition that another member of the link group made on this instance, this must be called from a callback that ALSA invokes with the lock of the PCM held.
+     * @note The state can't be set by the other member directly, as the thread using this PCM could be in the middle of a call into ALSA with it.
+     */
+    void ApplyLinkedState() {
+        if (linkedState.load(std::memory_order_relaxed) < 0)
+            return;
+
+        int target{linkedState.exchange(-1, std::memory_order_acquire)};
+        snd_pcm_state_t state{plug.state};
+        if (target == SND_PCM_STATE_RUNNING && state == SND_PCM_STATE_PREPARED)
+            snd_pcm_ioplug_set_state(&plug, SND_PCM_STATE_RUNNING);
+        else if (target == SND_PCM_STATE_SETUP && (state == SND_PCM_STATE_RUNNING || state == SND_PCM_STATE_PAUSED || state == SND_PCM_STATE_DRAINING || state == SND_PCM_STATE_XRUN))
+            snd_pcm_ioplug_set_state(&plug, SND_PCM_STATE_SETUP);
+    }
+
+    /**
+     * @return The channel count that a stream opened with the current hardware parameters is driven with.
+     */
+    unsigned int GetDeviceChannels() const {
+        return configuredChannels ? configuredChannels : plug.channels;
+    }
+
+    /**
+     * @brief The parameters that a stream is opened with, these are captured with the mutex held so that the stream can be opened without it.
+     */
+    struct StreamRequest {
+        OboePcm* instance; //!< The instance that the data callback of the stream forwards to.
+        bool capture;
+        bool paired; //!< If the stream is opened for the input of a duplex pair, it has no data callback of its own in that case.
+        snd_pcm_format_t format;
+        unsigned int channels; //!< The channel count of the application.
+        unsigned int deviceChannels;
+        unsigned int rate; //!< The sample rate of the application.
+        unsigned int deviceRate;
+        snd_pcm_uframes_t bufferSize;
+        oboe::InputPreset inputPreset;
+    };
+
+    /**
+     * @return The parameters of a stream for the current hardware parameters of the PCM, this must be called with the mutex held.
+     */
+    StreamRequest GetStreamRequest() {
+        return {
+            .instance = this,
+            .capture = capture,
+            .paired = capture && duplexPartner,
+            .format = plug.format,
+            .channels = plug.channels,
+            .deviceChannels = GetDeviceChannels(),
+            .rate = plug.rate,
+            .deviceRate = deviceRate,
+            .bufferSize = plug.buffer_size,
+            .inputPreset = inputPreset,
+        };
+    }
+
+    /**
+     * @brief Opens a stream with the supplied parameters, this doesn't touch the instance so it can be called without any mutex held.
+     * @param callback Receives the callback that forwards the data callbacks of the stream to the instance, this is null for the input of a duplex pair.
+     */
+    static int OpenStream(const StreamRequest& request, std::shared_ptr<StreamCallback>& callback, std::shared_ptr<oboe::AudioStream>& opened) {
+        // The device is always driven with its native channel count, if the application uses a different one then we convert it with our own mixer.
+        // The mixer and resampler work on floating point samples, so the stream uses those rather than the format of the application if either is required.
+        // Capture is always opened with the configuration of the application and left to Oboe to convert, it has no use for the mixer or resampler.
+        bool capture{request.capture};
+        bool convert{!capture && (request.channels != request.deviceChannels || request.deviceRate)};
+        oboe::AudioFormat format{[fmt = convert ? SND_PCM_FORMAT_FLOAT_LE : request.format]() {
+            switch (fmt) {
+                case SND_PCM_FORMAT_S16_LE:
+                    return oboe::AudioFormat::I16;
+                case SND_PCM_FORMAT_FLOAT_LE:
+                    return oboe::AudioFormat::Float;
+                case SND_PCM_FORMAT_S24_3LE:
+                    return oboe::AudioFormat::I24;
+                case SND_PCM_FORMAT_S32_LE:
+                    return oboe::AudioFormat::I32;
+                default:
+                    return oboe::AudioFormat::Invalid;
             }
+        }()};
+
+        // Configurations that the device recently rejected or capped below the requested capacity are failed without the round trip of opening a stream.
+        CapabilityCache::Key key{
+            .api = oboe::AudioApi::OpenSLES,
+            .direction = capture ? oboe::Direction::Input : oboe::Direction::Output,
+            .format = format,
+            .sampleRate = static_cast<int32_t>(request.deviceRate ? request.deviceRate : request.rate),
+            .channelCount = static_cast<int32_t>(capture ? request.channels : request.deviceChannels),
+        };
+        CapabilityCache::Capabilities cached{};
+        bool isCached{CapabilityCache::Find(key, cached)};
+        if (isCached && cached.unsupported) {
+            std::cerr << "[ALSA Oboe] Configuration was previously rejected by the device: " << oboe::convertToText(format) << " @ " << key.sampleRate << "Hz" << std::endl;
+            return -EINVAL;
+        }
+        if (isCached && !request.deviceRate && cached.capacityLimit && static_cast<snd_pcm_uframes_t>(cached.capacityLimit) < request.bufferSize) {
+            std::cerr << "[ALSA Oboe] Buffer size larger than the device supports: " << cached.capacityLimit << " < " << request.bufferSize << std::endl;
+            return -EIO;
         }
 
-        result = self->stream->requestFlush();
+        oboe::AudioStreamBuilder builder;
+        builder.setUsage(oboe::Usage::Game)
+            ->setDirection(capture ? oboe::Direction::Input : oboe::Direction::Output)
+            // Note: There is some instability related to using LowLatency mode on certain devices.
+            // Notably, while running mono 16-bit 48kHz audio on certain QCOM devices, the HAL simply raises a SIGABRT with no logs.
+            ->setPerformanceMode(oboe::PerformanceMode::LowLatency)
+            ->setSharingMode(oboe::SharingMode::Shared)
+            ->setFormat(format)
+            ->setFormatConversionAllowed(true)
+            ->setChannelCount(key.channelCount)
+            // Note: Oboe's channel conversion only kicks in if the device can't be opened with the native channel count we've been configured with.
+            ->setChannelConversionAllowed(true)
+            ->setSampleRate(key.sampleRate)
+            ->setSampleRateConversionQuality(oboe::SampleRateConversionQuality::Medium)
+            ->setAudioApi(oboe::AudioApi::OpenSLES);
+
+        // The input of a duplex pair is read by the data callback of the output, so its stream is opened for non-blocking reads instead of a callback.
+        callback = request.paired ? nullptr : std::make_shared<StreamCallback>(request.instance);
+        builder.setDataCallback(callback.get());
+
+        // The preset selects the processing of the input, anything but Unprocessed and VoicePerformance goes through the AEC/NS pipeline of Android which adds latency.
+        // Note: VoicePerformance is only available from Android 10, older versions may substitute another preset which is reported in the dump.
+        if (capture)
+            builder.setInputPreset(request.inputPreset);
+        if (!request.deviceRate)
+            builder.setBufferCapacityInFrames(static_cast<int32_t>(request.bufferSize)); // The stream is kept across changes of the buffer size when it runs at a fixed rate, so it keeps the default capacity.
+
+        oboe::Result result{builder.openStream(opened)};
         if (result != oboe::Result::OK) {
-            std::cerr << "[ALSA Oboe] Failed to flush stream: " << oboe::convertToText(result) << std::endl;
+            std::cerr << "[ALSA Oboe] Failed to open stream: " << oboe::convertToText(result) << std::endl;
+            // Only rejections of the format or rate are recorded, other failures such as the device being busy or an illegal argument during a route change can be transient.
+            if (result == oboe::Result::ErrorInvalidFormat || result == oboe::Result::ErrorInvalidRate)
+                CapabilityCache::Record(key, {.capacityLimit = cached.capacityLimit, .framesPerBurst = cached.framesPerBurst, .unsupported = true, .checked = CapabilityCache::GetTime()});
             return -1;
         }
 
-        state = self->stream->getState();
-        while (state != oboe::StreamState::Flushed) {
-            result = self->stream->waitForStateChange(oboe::StreamState::Flushing, &state, TimeoutNanoseconds);
-            if (result != oboe::Result::OK) {
-                std::cerr << "[ALSA Oboe] Failed to wait for flush: " << oboe::convertToText(result) << std::endl;
-                return -1;
+        // A successful probe lifts any rejection, and a capacity limit once the device grants more than it.
+        int32_t capacity{opened->getBufferCapacityInFrames()};
+        bool capped{!request.deviceRate && static_cast<snd_pcm_uframes_t>(capacity) < request.bufferSize};
+        if (capped)
+            CapabilityCache::Record(key, {.capacityLimit = capacity, .framesPerBurst = opened->getFramesPerBurst(), .unsupported = false, .checked = CapabilityCache::GetTime()});
+        else if (cached.capacityLimit && capacity <= cached.capacityLimit)
+            CapabilityCache::Record(key, {.capacityLimit = cached.capacityLimit, .framesPerBurst = opened->getFramesPerBurst(), .unsupported = false, .checked = cached.checked});
+        else
+            CapabilityCache::Record(key, {.capacityLimit = 0, .framesPerBurst = opened->getFramesPerBurst(), .unsupported = false, .checked = 0});
+        if (capped) {
+            // Note: This should never happen with AAudio, but it's possible with OpenSL ES.
+            std::cerr << "[ALSA Oboe] Buffer size smaller than requested: " << capacity << " < " << request.bufferSize << std::endl;
+            Retire({.callback = std::move(callback), .stream = std::move(opened)});
+            return -EIO;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief Replaces the stream with one that has been opened with the supplied parameters, this must be called with the mutex held.
+     */
+    void AdoptStream(const StreamRequest& request, std::shared_ptr<StreamCallback>&& callback, std::shared_ptr<oboe::AudioStream>&& opened) {
+        RetireStream();
+        stream = std::move(opened);
+        streamCallback = std::move(callback);
+        streamPaired = request.paired;
+        deviceChannels = request.deviceChannels;
+        outputFrameSize = stream->getBytesPerFrame();
+    }
+
+    /**
+     * @brief Opens a stream with the current hardware parameters of the PCM, this must be called with the mutex held.
+     * @note This blocks on the device, prepare is the only call of the application that does so as it can't complete without a stream.
+     */
+    int OpenStream() {
+        StreamRequest request{GetStreamRequest()};
+        std::shared_ptr<StreamCallback> callback;
+        std::shared_ptr<oboe::AudioStream> opened;
+        int err{OpenStream(request, callback, opened)};
+        if (err < 0)
+            return err;
+
+        AdoptStream(request, std::move(callback), std::move(opened));
+        return 0;
+    }
+
+    /**
+     * @brief Sets up the conversion from the format, channel layout and rate of the application to those of the stream, this must be called with the mutex held.
+     */
+    int ConfigureTransfer() {
+        if (capture) {
+            // Captured frames are copied into the ring as they are, the copy kernel is still used so that the input is metered.
+            kernels = kernels::Select(plug.format, plug.access, plug.channels, plug.channels, false);
+            if (!kernels.read) {
+                std::cerr << "[ALSA Oboe] Unsupported configuration: " << snd_pcm_format_name(plug.format) << " with " << plug.channels << " channels" << std::endl;
+                return -EINVAL;
+            }
+            mixer.reset();
+            resampler.reset();
+            streamRate = static_cast<unsigned int>(stream->getSampleRate());
+            startThreshold = 0;
+            if (streamPaired)
+                inputBlock = std::make_unique<uint8_t[]>(InputBlockFrames * frameSize);
+            return 0;
+        }
+
+        kernels = kernels::Select(plug.format, plug.access, plug.channels, deviceChannels, stream->getFormat() == oboe::AudioFormat::Float);
+        if (!kernels.write) {
+            std::cerr << "[ALSA Oboe] Unsupported configuration: " << snd_pcm_format_name(plug.format) << " with " << plug.channels << " channels" << std::endl;
+            return -EINVAL;
+        }
+        mixer = kernels.mix ? std::make_unique<ChannelMixer>(plug.channels, deviceChannels) : nullptr;
+
+        streamRate = static_cast<unsigned int>(stream->getSampleRate());
+        resampler.reset();
+        if (streamRate != plug.rate) {
+            resampler.reset(oboe::resampler::MultiChannelResampler::make(static_cast<int32_t>(deviceChannels), static_cast<int32_t>(plug.rate), static_cast<int32_t>(streamRate), oboe::resampler::MultiChannelResampler::Quality::Medium));
+            if (!resampler)
+                return -ENOMEM;
+            resampleBlock.resize(ResampleBlockFrames * deviceChannels);
+        }
+        resampleBlockOffset = resampleBlockFrames = 0;
+
+        startThreshold = 0;
+        if (latencyMilliseconds) {
+            // The stream is given whatever remains of the target after the ring, but always at least two bursts as anything less is prone to glitches.
+            int32_t burst{stream->getFramesPerBurst()};
+            int64_t targetFrames{static_cast<int64_t>(latencyMilliseconds) * streamRate / 1000}, bufferFrames{static_cast<int64_t>(plug.buffer_size) * streamRate / plug.rate};
+            int64_t bursts{std::max<int64_t>((targetFrames - bufferFrames + burst - 1) / burst, 2)};
+            auto bufferSize{stream->setBufferSizeInFrames(static_cast<int32_t>(std::min<int64_t>(bursts * burst, stream->getBufferCapacityInFrames())))};
+            if (!bufferSize)
+                std::cerr << "[ALSA Oboe] Failed to set buffer size: " << oboe::convertToText(bufferSize.error()) << std::endl;
+
+            // The stream is started once a period has been queued rather than on the first write, so the ring doesn't immediately run dry.
+            // The start threshold of the application is left as it is, a start that ALSA issues before this is reached is deferred until it is.
+            startThreshold = plug.period_size;
+
+            int64_t achieved{GetLatencyMilliseconds()};
+            if (achieved > latencyMilliseconds)
+                std::cerr << "[ALSA Oboe] Latency target of " << latencyMilliseconds << "ms missed, achieved " << achieved << "ms" << std::endl;
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Opens new taps if the configuration of the PCM changed since the current ones were opened, this must be called with the mutex held while the ring isn't consumed.
+     */
+    void OpenTaps() {
+        auto path{[this](const char* side) {
+            return tapDirectory + "/oboe-" + std::to_string(getpid()) + "-" + std::to_string(tapSerial.fetch_add(1, std::memory_order_relaxed)) + (capture ? "-capture-" : "-playback-") + side + ".wav";
+        }};
+
+        if (!applicationTap || !applicationTap->Matches(plug.format, plug.channels, plug.rate)) {
+            applicationTap.reset(); // The previous file is finalized before the next one is created.
+            applicationTap = WavTap::Create(path("application"), plug.format, plug.channels, plug.rate);
+        }
+
+        if (!tapDevice || capture)
+            return; // Capture streams are opened with the configuration of the application, so the device side is identical.
+
+        snd_pcm_format_t format{[streamFormat = stream->getFormat()]() {
+            switch (streamFormat) {
+                case oboe::AudioFormat::I16:
+                    return SND_PCM_FORMAT_S16_LE;
+                case oboe::AudioFormat::I24:
+                    return SND_PCM_FORMAT_S24_3LE;
+                case oboe::AudioFormat::I32:
+                    return SND_PCM_FORMAT_S32_LE;
+                default:
+                    return SND_PCM_FORMAT_FLOAT_LE;
+            }
+        }()};
+        auto channels{static_cast<unsigned int>(stream->getChannelCount())}, rate{static_cast<unsigned int>(stream->getSampleRate())};
+        if (!deviceTap || !deviceTap->Matches(format, channels, rate)) {
+            deviceTap.reset();
+            deviceTap = WavTap::Create(path("device"), format, channels, rate);
+        }
+    }
+
+    /**
+     * @return The latency from a write into a full ring to its presentation in milliseconds, this must be called with the mutex held.
+     * @note This uses the latency reported by the stream when it's available, otherwise the buffer of the stream is assumed to be full.
+     */
+    int64_t GetLatencyMilliseconds() {
+        int64_t ringLatency{static_cast<int64_t>(plug.buffer_size) * 1000 / plug.rate};
+        auto deviceLatency{stream->calculateLatencyMillis()};
+        if (deviceLatency)
+            return ringLatency + static_cast<int64_t>(std::lround(deviceLatency.value()));
+        return ringLatency + static_cast<int64_t>(stream->getBufferSizeInFrames()) * 1000 / stream->getSampleRate();
+    }
+
+    /**
+     * @brief Hands the stream over to the service thread to be closed, this must be called with the mutex held.
+     * @note This only waits on a data callback that's in progress, never on the device.
+     */
+    void RetireStream() {
+        if (!stream)
+            return;
+
+        DetachInput();
+        if (streamCallback)
+            streamCallback->Detach();
+        Retire({.callback = std::move(streamCallback), .stream = std::move(stream)});
+        stream.reset();
+        streamCallback.reset();
+    }
+
+    /**
+     * @brief Queues a stream that's detached from its instance to be closed by the service thread.
+     */
+    static void Retire(RetiredStream&& retired) {
+        {
+            std::scoped_lock lock{serviceMutex};
+            retiredStreams.push_back(std::move(retired));
+            serviceRequested = true;
+        }
+        serviceCondition.notify_all();
+    }
+
+    /**
+     * @brief Has the service thread check on all instances right away, rather than at its next interval.
+     */
+    static void WakeService() {
+        {
+            std::scoped_lock lock{serviceMutex};
+            serviceRequested = true;
+        }
+        serviceCondition.notify_all();
+    }
+
+    /**
+     * @brief Closes all retired streams, this is only called by the service thread with no mutex held as closing a stream can block on a hung device.
+     */
+    static void CloseRetiredStreams() {
+        std::vector<RetiredStream> streams;
+        {
+            std::scoped_lock lock{serviceMutex};
+            streams.swap(retiredStreams);
+        }
+        for (RetiredStream& retired : streams)
+            retired.stream->close();
+    }
+
+    /**
+     * @brief A transition of the stream of an instance, the service thread carries these out without holding any mutex as they block on the device.
+     */
+    struct StreamTask {
+        enum class Type : uint8_t {
+            Start, //!< Starts the stream.
+            Stop, //!< Pauses and flushes the stream.
+            Reopen, //!< Opens a stream that replaces a stalled or unresponsive one, it continues from the current position of the ring.
+        } type;
+        OboePcm* instance;
+        std::shared_ptr<oboe::AudioStream> stream; //!< The stream of the instance at the time the task was planned, the outcome is discarded if the instance has replaced it since.
+        uint64_t generation; //!< The prepare generation of the instance at the time the task was planned.
+        int64_t timeout; //!< The time that a stop is given to settle.
+        StreamRequest request; //!< The parameters that a replacement is opened with.
+        int result;
+        std::shared_ptr<StreamCallback> callback; //!< The callback of the replacement, this is declared prior to it so that it outlives the stream.
+        std::shared_ptr<oboe::AudioStream> opened; //!< The replacement, this is null if it hasn't been adopted by the instance.
+    };
+
+    /**
+     * @brief Plans the transition of the stream that the state of the PCM calls for, if any. This must be called with the mutex held.
+     * @note The stream keeps running while the ring is consumed or filled, while the input of a duplex pair is attached to it and for the idle timeout after that.
+     *       A running stream whose data callback hasn't been invoked within the watchdog timeout is replaced, as is one that failed to stop.
+     */
+    void PlanStreamTask(std::vector<StreamTask>& tasks) {
+        if (!stream)
+            return;
+
+        int64_t now{GetMonotonicNanoseconds()};
+        oboe::StreamState state{stream->getState()};
+        if (!reopenWanted && watchdogTimeout && (state == oboe::StreamState::Started || state == oboe::StreamState::Disconnected) && now - callbackTimestamp.load(std::memory_order_relaxed) >= watchdogTimeout) {
+            // A disconnected stream stops invoking the data callback, so it's handled like any other stall.
+            std::cerr << "[ALSA Oboe] Stream stalled for " << (now - callbackTimestamp.load(std::memory_order_relaxed)) / 1000000 << "ms, rebuilding it" << std::endl;
+            stallRecoveries++;
+            reopenWanted = true;
+        }
+        if (reopenWanted) {
+            // A failed reopen is retried after the transition timeout, rather than opening a stream on every interval.
+            if (now - reopenTimestamp >= GetTransitionTimeout())
+                tasks.push_back({.type = StreamTask::Type::Reopen, .instance = this, .stream = stream, .generation = prepareGeneration, .request = GetStreamRequest()});
+            return;
+        }
+
+        bool started{state == oboe::StreamState::Started || state == oboe::StreamState::Starting};
+        bool active{running || duplexInput.load() || ringActive.load(std::memory_order_relaxed) || now - idleTimestamp < idleTimeout};
+        if (active && !started && !startFailed.load(std::memory_order_relaxed)) {
+            callbackTimestamp.store(now, std::memory_order_relaxed); // The stream is given the entire watchdog timeout to invoke its first callback.
+            tasks.push_back({.type = StreamTask::Type::Start, .instance = this, .stream = stream, .generation = prepareGeneration});
+        } else if (!active && started) {
+            DetachInput(); // The output of a duplex pair only keeps running for as long as its input does.
+            tasks.push_back({.type = StreamTask::Type::Stop, .instance = this, .stream = stream, .generation = prepareGeneration, .timeout = GetTransitionTimeout()});
+        }
+    }
+
+    /**
+     * @brief Carries out a task on its stream, this is only called by the service thread without any mutex held as it blocks on the device.
+     */
+    static void RunStreamTask(StreamTask& task) {
+        switch (task.type) {
+            case StreamTask::Type::Start: {
+                oboe::Result result{task.stream->requestStart()};
+                if (result != oboe::Result::OK)
+                    std::cerr << "[ALSA Oboe] Failed to start stream: " << oboe::convertToText(result) << std::endl;
+                task.result = result == oboe::Result::OK ? 0 : -1;
+                break;
+            }
+
+            case StreamTask::Type::Stop:
+                task.result = StopStream(*task.stream, GetMonotonicNanoseconds() + task.timeout);
+                break;
+
+            case StreamTask::Type::Reopen:
+                task.result = OpenStream(task.request, task.callback, task.opened);
+                break;
+        }
+    }
+
+    /**
+     * @brief Applies the outcome of a task that was carried out on the current stream, this must be called with the mutex held.
+     */
+    void CompleteStreamTask(StreamTask& task) {
+        switch (task.type) {
+            case StreamTask::Type::Start:
+                if (task.result < 0) {
+                    // The ring has been started as far as ALSA is concerned, so this is reported as an xrun. The start isn't retried until the PCM is prepared again.
+                    startFailed.store(true, std::memory_order_release);
+                    Notify();
+                }
+                break;
+
+            case StreamTask::Type::Stop:
+                if (task.result < 0) {
+                    // A stream that can't be stopped would keep consuming or producing audio behind our back, a new stream is stopped from the start.
+                    if (task.result == -ETIMEDOUT)
+                        std::cerr << "[ALSA Oboe] Stream didn't stop within " << task.timeout / 1000000 << "ms, rebuilding it" << std::endl;
+                    else
+                        std::cerr << "[ALSA Oboe] Stream failed to stop, rebuilding it" << std::endl;
+                    deadlineRecoveries++;
+                    reopenWanted = true;
+                    WakeService();
+                }
+                break;
+
+            case StreamTask::Type::Reopen: {
+                if (task.result < 0) {
+                    // The old stream is kept until a replacement can be opened, any writer is woken up so it doesn't block on it forever and receives an xrun.
+                    reopenTimestamp = GetMonotonicNanoseconds();
+                    startFailed.store(true, std::memory_order_release);
+                    Notify();
+                    break;
+                }
+
+                // The old stream may never respond again if the device is hung, it's closed along with the other retired streams.
+                AdoptStream(task.request, std::move(task.callback), std::move(task.opened));
+                reopenWanted = false;
+
+                // The new stream needs the buffer size that the latency target derives for it, and its burst or rate may not match those of the old one.
+                // The new stream hasn't been started yet, so the conversion can be set up again without racing its data callback.
+                int err{ConfigureTransfer()};
+                if (err < 0) {
+                    std::cerr << "[ALSA Oboe] Failed to configure rebuilt stream, the PCM needs to be prepared again" << std::endl;
+                    RetireStream();
+                    startFailed.store(true, std::memory_order_release);
+                    Notify();
+                    break;
+                }
+
+                // Any scheduled start was either already reached or is irrecoverable at this point, the ring simply resumes from where it was once the stream is started.
+                startTarget.store(0, std::memory_order_relaxed);
+                if (draining) {
+                    // The new stream has no record of the frames that were handed to the old one, those are lost so the drain continues from the ring as it is now.
+                    PushCommand({.type = Command::Type::Drain, .position = applPosition.load(), .serial = drainsIssued});
+                }
+                if (streamPaired && running)
+                    AttachInput();
+                break;
+            }
+        }
+    }
+
+    /**
+     * @brief Applies the outcome of the tasks to the instances that they were planned for, replacements that weren't adopted are retired.
+     */
+    static void CompleteStreamTasks(std::vector<StreamTask>& tasks) {
+        {
+            std::scoped_lock instancesLock{instancesMutex};
+            for (StreamTask& task : tasks) {
+                // The instance may have been closed, prepared again or replaced its stream while the task was carried out. Its outcome no longer applies in those cases.
+                if (std::find(instances.begin(), instances.end(), task.instance) == instances.end())
+                    continue;
+                std::unique_lock instanceLock{task.instance->mutex, std::try_to_lock};
+                if (instanceLock.owns_lock() && task.instance->stream == task.stream && task.instance->prepareGeneration == task.generation)
+                    task.instance->CompleteStreamTask(task);
+            }
+        }
+
+        // A replacement that wasn't adopted has never been started, it's simply closed along with the retired streams.
+        for (StreamTask& task : tasks) {
+            if (!task.opened)
+                continue;
+            if (task.callback)
+                task.callback->Detach();
+            Retire({.callback = std::move(task.callback), .stream = std::move(task.opened)});
+        }
+    }
+
+    /**
+     * @brief Wakes up the application if a non-blocking drain it's polling missed its deadline, its next call to drain then replaces the stream. This must be called with the mutex held.
+     */
+    void ExpireDrain() {
+        if (pendingDrainSerial.load(std::memory_order_relaxed) && GetMonotonicNanoseconds() > drainDeadline.load(std::memory_order_relaxed))
+            Notify();
+    }
+
+    static void ServiceLoop(uint64_t generation) {
+        std::vector<StreamTask> tasks;
+        std::unique_lock lock{serviceMutex};
+        while (serviceGeneration == generation) {
+            serviceCondition.wait_for(lock, std::chrono::nanoseconds{ServiceIntervalNanoseconds}, [generation] { return serviceGeneration != generation || serviceRequested; });
+            if (serviceGeneration != generation)
+                break;
+            serviceRequested = false;
+
+            lock.unlock();
+            CloseRetiredStreams();
+            {
+                std::scoped_lock instancesLock{instancesMutex};
+                for (OboePcm* instance : instances) {
+                    // An instance whose mutex is held may be opening its stream in a prepare, which mustn't hold up the others.
+                    // It's skipped until the next interval rather than waiting on it with instancesMutex held, which would also block opening and closing any PCM.
+                    std::unique_lock instanceLock{instance->mutex, std::try_to_lock};
+                    if (!instanceLock.owns_lock())
+                        continue;
+                    instance->PlanStreamTask(tasks);
+                    instance->ExpireDrain();
+                }
+            }
+
+            // The transitions block on the device, so they're carried out without any mutex held. The application never waits on them.
+            for (StreamTask& task : tasks)
+                RunStreamTask(task);
+            if (!tasks.empty())
+                CompleteStreamTasks(tasks);
+            tasks.clear();
+
+            CapabilityCache::Flush(); // Streams are opened in the prepare of the application as well, so the probes are persisted from here rather than there.
+            lock.lock();
+        }
+
+        // The last instance is gone, its stream is closed and anything it probed since the last interval is persisted before the thread exits.
+        lock.unlock();
+        CloseRetiredStreams();
+        CapabilityCache::Flush();
+
+        lock.lock();
+        serviceExits = std::max(serviceExits, generation + 1);
+        serviceCondition.notify_all();
+    }
+
+    /**
+     * @brief Keeps the service thread alive until a matching call to ReleaseService, the thread is started if it isn't running already.
+     */
+    static void AcquireService() {
+        std::scoped_lock lock{serviceMutex};
+        if (serviceReferences++ == 0)
+            serviceThread = std::thread{ServiceLoop, serviceGeneration};
+    }
+
+    /**
+     * @note This must be called without instancesMutex held as the service thread locks it.
+     */
+    static void ReleaseService() {
+        std::unique_lock lock{serviceMutex};
+        if (--serviceReferences != 0)
+            return;
+
+        uint64_t generation{serviceGeneration++};
+        std::thread thread{std::move(serviceThread)};
+        serviceCondition.notify_all();
+
+        // The thread closes the remaining retired streams before exiting, which can block for arbitrarily long on a hung device.
+        // It's left to finish on its own in that case, so closing the last PCM doesn't hang along with the device.
+        bool exited{serviceCondition.wait_for(lock, std::chrono::nanoseconds{ServiceExitTimeoutNanoseconds}, [generation] { return serviceExits > generation; })};
+        lock.unlock();
+        if (exited) {
+            thread.join();
+        } else {
+            std::cerr << "[ALSA Oboe] Service thread is blocked on the device, detaching it" << std::endl;
+            thread.detach();
+        }
+    }
+
+    static int Start(snd_pcm_ioplug_t* ext) {
+        auto* self{static_cast<OboePcm*>(ext->private_data)};
+        std::shared_ptr<LinkGroup> group;
+        {
+            std::scoped_lock lock{self->mutex};
+            if (!self->stream)
+                return -EBADFD; // This should be checked by pcm_ioplug but we'll do it here too.
+            self->linkedState.store(-1, std::memory_order_relaxed); // ALSA transitions the state itself from here on.
+            if (self->running)
+                return 0; // A write already started the ring prior to ALSA reaching its start threshold, restarting it would insert the prefill into the audio.
+
+            // The start threshold of the application may be below our own, see ConfigureTransfer. The ring is then started by the write that reaches ours rather than running dry right away.
+            if (!self->capture && self->applPosition.load(std::memory_order_relaxed) < self->startThreshold) {
+                self->startDeferred = true;
+                return 0;
+            }
+
+            group = self->linkGroup;
+            if (!group) {
+                oboe::Result result{self->StartRing()};
+                if (result != oboe::Result::OK) {
+                    std::cerr << "[ALSA Oboe] Failed to start stream: " << oboe::convertToText(result) << std::endl;
+                    return -1;
+                }
+
+                return 0;
+            }
+        }
+
+        return StartLinked(*group, self);
+    }
+
+    static int Stop(snd_pcm_ioplug_t* ext) {
+        auto* self{static_cast<OboePcm*>(ext->private_data)};
+        std::shared_ptr<LinkGroup> group;
+        {
+            std::scoped_lock lock{self->mutex};
+            if (!self->stream)
+                return -EBADFD;
+
+            // ALSA also stops the PCM once its drain completes, that only ends this member as the others still have their own frames to play until they're drained or dropped.
+            self->linkedState.store(-1, std::memory_order_relaxed);
+            group = self->linkGroup;
+            if (!group || self->drained) {
+                self->drained = false;
+                self->StopRing(true);
+                return 0;
             }
         }
 
+        StopLinked(*group, self);
         return 0;
     }
 
     static snd_pcm_sframes_t Pointer(snd_pcm_ioplug_t* ext) {
         auto* self{static_cast<OboePcm*>(ext->private_data)};
-        std::scoped_lock lock{self->mutex};
-        if (!self->stream)
-            return -EBADFD;
+        self->ApplyLinkedState();
 
         // Note: This function would return an error for any Xruns but we don't bother as Oboe automatically recovers from them.
+        //       The exceptions are overruns of the capture ring when they're configured to be reported, the input that was lost can't be recovered,
+        //       and streams that failed to start after ALSA was told the PCM started or that stalled and couldn't be rebuilt.
+        // Note: This is called extremely frequently by some applications, so it doesn't lock the mutex or call into the stream.
+        //       pcm_ioplug only calls it after a successful prepare, so we don't need to check if the stream exists.
 
-        int64_t framesWritten{self->stream->getFramesWritten()};
-        if (framesWritten < 0) {
-            std::cerr << "[ALSA Oboe] Failed to get frames written: " << framesWritten << std::endl;
-            return -1;
+        // We report the amount of frames that the data callback has consumed from the ring, wrapped at the boundary rather than the buffer size.
+        // This is required as the callback may consume more than a buffer's worth of frames between two calls on a stalled application.
+        if (self->overrunXrun && self->overrunPending.load(std::memory_order_acquire))
+            return -EPIPE;
+        if (self->startFailed.load(std::memory_order_acquire))
+            return -EPIPE;
+        return self->status.Read().hwPosition % self->boundary;
+    }
+
+    static int Delay(snd_pcm_ioplug_t* ext, snd_pcm_sframes_t* delayp) {
+        auto* self{static_cast<OboePcm*>(ext->private_data)};
+        self->ApplyLinkedState();
+
+        // The delay is the amount of frames in the ring and the frames that Oboe hasn't presented yet.
+        // The latter is extrapolated from the time of the last snapshot to avoid a round trip into the stream, it can't go below zero as the ring might've run dry.
+        StatusPage::Status snapshot{self->status.Read()};
+        if (self->capture) {
+            // The delay of a capture is the amount of frames in the ring and those which the device has captured since the last snapshot.
+            snd_pcm_sframes_t delay{static_cast<snd_pcm_sframes_t>(snapshot.hwPosition - self->applPosition.load(std::memory_order_acquire))};
+            if (snapshot.timestamp)
+                delay += std::min<int64_t>((GetMonotonicNanoseconds() - snapshot.timestamp) * ext->rate / oboe::kNanosPerSecond, snapshot.deviceDelay);
+            *delayp = delay;
+            return 0;
+        }
+
+        snd_pcm_sframes_t delay{static_cast<snd_pcm_sframes_t>(self->applPosition.load(std::memory_order_acquire) - snapshot.hwPosition)};
+        if (snapshot.timestamp) {
+            int64_t elapsedFrames{(GetMonotonicNanoseconds() - snapshot.timestamp) * ext->rate / oboe::kNanosPerSecond};
+            delay += std::max<int64_t>(snapshot.deviceDelay - elapsedFrames, 0);
+        } else {
+            delay += self->prefillFrames.load(std::memory_order_relaxed) * ext->rate / self->streamRate; // Until the first callback, all of the prefill is still ahead of the ring.
         }
 
-        // We don't care about the device ring buffer position as Oboe handles writing samples to it.
-        // Instead, we just need to return the current position relative to the imaginary ALSA buffer size.
-        return framesWritten % ext->buffer_size;
+        *delayp = delay;
+        return 0;
     }
 
     static snd_pcm_sframes_t Transfer(snd_pcm_ioplug_t* ext, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t size) {
         auto* self{static_cast<OboePcm*>(ext->private_data)};
+        self->ApplyLinkedState();
         std::unique_lock lock{self->mutex};
         if (!self->stream)
             return -EBADFD;
         if (size == 0)
             return 0;
 
-        if (self->stream->getState() != oboe::StreamState::Started) {
-            // ALSA expects us to automatically start the stream if it's not started.
-            oboe::Result result{self->stream->requestStart()};
-            if (result != oboe::Result::OK) {
-                std::cerr << "[ALSA Oboe] Failed to start stream from transfer: " << oboe::convertToText(result) << std::endl;
-                return -1;
-            }
+        // Note: ALSA only calls us with at most the available amount of frames, so this should never need to be clamped in practice.
+        uint64_t appl{self->applPosition.load(std::memory_order_relaxed)};
+        snd_pcm_uframes_t frames{std::min(size, self->GetAvail())};
+        if (frames == 0)
+            return -EAGAIN;
+
+        size_t ringOffset{appl % self->ringFrames}, firstFrames{std::min<size_t>(frames, self->ringFrames - ringOffset)};
+        if (self->capture) {
+            // ALSA starts a capture itself prior to the first read, so there's nothing to start here.
+            self->kernels.read(self->ring.get() + ringOffset * self->frameSize, areas, offset, firstFrames);
+            self->kernels.read(self->ring.get(), areas, offset + firstFrames, frames - firstFrames);
+            self->TapRing(appl, frames);
+            self->applPosition.store(appl + frames);
+            return frames;
         }
 
-        auto& firstArea{areas[0]};
-        auto* address{reinterpret_cast<uint8_t*>(firstArea.addr)};
+        self->kernels.write(areas, offset, self->ring.get() + ringOffset * self->frameSize, firstFrames);
+        self->kernels.write(areas, offset + firstFrames, self->ring.get(), frames - firstFrames);
+        self->TapRing(appl, frames);
+        self->applPosition.store(appl + frames);
 
-#ifndef NDEBUG
-        uint channelOffset{0};
-        for (unsigned int c{0}; c < ext->channels; ++c) {
-            auto& area{areas[c]};
-            if (area.addr != firstArea.addr || area.step != firstArea.step || area.first >= firstArea.step) {
-                std::cerr << "[ALSA Oboe] Attempt to transfer non-interleaved samples" << std::endl;
-                return -1;
+        if (!self->running && (self->plug.state == SND_PCM_STATE_PREPARED || self->startDeferred) && appl + frames >= self->startThreshold) {
+            // ALSA expects us to automatically start the stream if it's not started, a paused PCM is only started again by resuming it.
+            // A start that ALSA already issued below our threshold is carried out here as well.
+            // The frames have been committed to the ring at this point, so a failure is reported as an xrun rather than having ALSA write them again.
+            if (self->linkGroup) {
+                std::shared_ptr<LinkGroup> group{self->linkGroup};
+                lock.unlock(); // The group must be locked prior to any of its members.
+                if (StartLinked(*group, self) < 0)
+                    self->startFailed.store(true, std::memory_order_release);
+                return frames;
             }
-        }
-#endif
 
-        oboe::ResultWithValue<int32_t> result{self->stream->write(address, size, ext->nonblock ? 0 : TimeoutNanoseconds)};
-        if (result != oboe::Result::OK) {
-            std::cerr << "[ALSA Oboe] Failed to write samples to stream: " << oboe::convertToText(result.error()) << std::endl;
-            return -1;
-        } else if (result.value() == 0) {
-            if (!ext->nonblock)
-                std::cerr << "[ALSA Oboe] Cannot write samples in blocking mode" << std::endl;
-            return -EAGAIN; // Oboe will return 0 if the stream is non-blocking and there's no space in the buffer.
+            oboe::Result result{self->StartRing()};
+            if (result != oboe::Result::OK) {
+                std::cerr << "[ALSA Oboe] Failed to start stream from transfer: " << oboe::convertToText(result) << std::endl;
+                self->startFailed.store(true, std::memory_order_release);
+            }
         }
 
-        return result.value();
+        return frames;
     }
 
     static int Close(snd_pcm_ioplug_t* ext) {
         if (ext->private_data) {
-            ext->private_data = nullptr;
             auto* self{static_cast<OboePcm*>(ext->private_data)};
+            ext->private_data = nullptr;
             delete self;
         }
         return 0;
@@ -159,110 +2926,295 @@ class OboePcm {
     static int Prepare(snd_pcm_ioplug_t* ext) {
         auto* self{static_cast<OboePcm*>(ext->private_data)};
         std::scoped_lock lock{self->mutex};
-        if (self->stream)
-            return 0;
 
-        oboe::AudioStreamBuilder builder;
-        builder.setUsage(oboe::Usage::Game)
-            ->setDirection(oboe::Direction::Output)
-            // Note: There is some instability related to using LowLatency mode on certain devices.
-            // Notably, while running mono 16-bit 48kHz audio on certain QCOM devices, the HAL simply raises a SIGABRT with no logs.
-            ->setPerformanceMode(oboe::PerformanceMode::LowLatency)
-            ->setSharingMode(oboe::SharingMode::Shared)
-            ->setFormat([fmt = ext->format]() {
-                switch (fmt) {
-                    case SND_PCM_FORMAT_S16_LE:
-                        return oboe::AudioFormat::I16;
-                    case SND_PCM_FORMAT_FLOAT_LE:
-                        return oboe::AudioFormat::Float;
-                    case SND_PCM_FORMAT_S24_3LE:
-                        return oboe::AudioFormat::I24;
-                    case SND_PCM_FORMAT_S32_LE:
-                        return oboe::AudioFormat::I32;
-                    default:
-                        return oboe::AudioFormat::Invalid;
-                }
-            }())
-            ->setFormatConversionAllowed(true)
-            ->setChannelCount(ext->channels)
-            ->setChannelConversionAllowed(true)
-            ->setSampleRate(ext->rate)
-            ->setSampleRateConversionQuality(oboe::SampleRateConversionQuality::Medium)
-            ->setBufferCapacityInFrames(ext->buffer_size)
-            ->setAudioApi(oboe::AudioApi::OpenSLES);
+        // A prepare can occur while the ring is being consumed, the data callback needs to stop consuming it before the ring and positions can be reset.
+        // The stream itself keeps running, the data callback doesn't touch anything but its commands while it isn't consuming the ring. Captured input is dropped in that state.
+        if (self->stream) {
+            if (self->running)
+                self->StopRing(true);
+            self->SyncCommands();
 
-        oboe::Result result{builder.openStream(self->stream)};
-        if (result != oboe::Result::OK) {
-            std::cerr << "[ALSA Oboe] Failed to open stream: " << oboe::convertToText(result) << std::endl;
-            return -1;
+            if (self->streamPaired != (self->capture && self->duplexPartner) || (!self->capture && self->deviceChannels != self->GetDeviceChannels())) {
+                // The pairing of the PCM changed since its stream was opened, the stream needs to be reopened with or without a data callback.
+                // A stream kept at a fixed rate is also reopened if it follows the channel count of the application and that changed.
+                self->RetireStream();
+            }
         }
 
-        if (self->stream->getBufferCapacityInFrames() < ext->buffer_size) {
-            // Note: This should never happen with AAudio, but it's possible with OpenSL ES.
-            std::cerr << "[ALSA Oboe] Buffer size smaller than requested: " << self->stream->getBufferCapacityInFrames() << " < " << ext->buffer_size << std::endl;
-            self->stream.reset();
-            return -EIO;
+        // The ring mirrors the ALSA buffer, it needs to be recreated whenever the hardware parameters change.
+        self->prepareGeneration++; // A stream that the service thread is opening with the previous parameters is discarded.
+        size_t frameSize{static_cast<size_t>(snd_pcm_format_physical_width(ext->format) / 8) * ext->channels};
+        if (!self->ring || self->ringFrames != ext->buffer_size || self->frameSize != frameSize) {
+            self->ring = std::make_unique<uint8_t[]>(ext->buffer_size * frameSize);
+            self->ringFrames = ext->buffer_size;
+            self->frameSize = frameSize;
+        }
+        if (self->capture && self->periodCount != ext->buffer_size / ext->period_size) {
+            self->periodCount = ext->buffer_size / ext->period_size;
+            self->periodTimestamps = std::make_unique<std::atomic<int64_t>[]>(self->periodCount);
+        }
+        self->meter.Reset(ext->channels, ext->rate / 10); // The levels are measured over 100ms windows, similar to a VU meter.
+
+        // ALSA resets its own pointers during a prepare, so we need to do the same for ours.
+        self->applPosition.store(0, std::memory_order_relaxed);
+        self->hwPosition.store(0, std::memory_order_relaxed);
+        self->status.Publish({});
+        self->periodEventPending.store(false, std::memory_order_relaxed);
+        self->startTarget.store(0, std::memory_order_relaxed);
+        self->prefillFrames.store(0, std::memory_order_relaxed);
+        self->underruns.store(0, std::memory_order_relaxed);
+        self->overruns.store(0, std::memory_order_relaxed);
+        self->overrunFrames.store(0, std::memory_order_relaxed);
+        self->overrunPending.store(false, std::memory_order_relaxed);
+        self->startFailed.store(false, std::memory_order_relaxed);
+        self->linkedState.store(-1, std::memory_order_relaxed);
+        self->drained = false;
+        self->startDeferred = false;
+        self->Notify(); // The ring is now completely empty, so any pollers can start writing to it.
+
+        if (!self->serviceAcquired) {
+            // The service thread only watches over streams and persists their probes, so it's started by the first prepare rather than keeping it on the path of opening the PCM.
+            // This precedes opening the stream, so that a rejected configuration is persisted even if no stream is ever opened successfully.
+            AcquireService();
+            self->serviceAcquired = true;
         }
 
+        if (!self->stream) {
+            int err{self->OpenStream()};
+            if (err < 0)
+                return err;
+        }
+
+        int err{self->ConfigureTransfer()};
+        if (err < 0)
+            return err;
+        if (!self->tapDirectory.empty())
+            self->OpenTaps();
+
+        if (!self->readyTimestamp)
+            self->readyTimestamp = GetMonotonicNanoseconds();
         return 0;
     }
 
-    static int Drain(snd_pcm_ioplug_t* ext) {
-        auto self{static_cast<OboePcm*>(ext->private_data)};
+    static int HwFree(snd_pcm_ioplug_t* ext) {
+        auto* self{static_cast<OboePcm*>(ext->private_data)};
         std::scoped_lock lock{self->mutex};
-        if (!self->stream)
-            return -EBADFD;
 
-        // We need to wait for the stream to read all samples during a drain.
-        // According to AAudio documentation, requestStop() guarantees that the stream's contents have been written to the device.
-        // However, in practice it doesn't seem to be the case, so we'll just poll the frames read until it reaches the frames written.
+        // The stream is opened with the hardware parameters at the time of the first prepare, so it needs to be reopened once they are freed.
+        // A stream running at a fixed device rate doesn't depend on them, it's kept so that changing the parameters doesn't cause a gap while it's reopened.
+        if (self->stream) {
+            if (self->deviceRate) {
+                if (self->running)
+                    self->StopRing(true);
+                self->SyncCommands();
+                return 0;
+            }
+
+            self->RetireStream();
+        }
 
-        struct timespec start;
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        start.tv_sec += 1;
+        return 0;
+    }
 
-        while (true) {
-            int64_t framesRead{self->stream->getFramesRead()};
-            if (framesRead < 0) {
-                std::cerr << "[ALSA Oboe] Failed to get frames read: " << framesRead << std::endl;
-                return -1;
+    static void Dump(snd_pcm_ioplug_t* ext, snd_output_t* out) {
+        auto* self{static_cast<OboePcm*>(ext->private_data)};
+        std::scoped_lock lock{self->mutex};
+
+        snd_output_printf(out, "Oboe PCM\n");
+        snd_output_printf(out, "  Kernels: %s\n", kernels::ToString(kernels::GetIsa()));
+        snd_output_printf(out, "  Startup: opened %.3fms after load in %.3fms", static_cast<double>(self->openTimestamp - LoadTimestamp) / 1e6, static_cast<double>(self->openedTimestamp - self->openTimestamp) / 1e6);
+        if (self->readyTimestamp)
+            snd_output_printf(out, ", ready %.3fms after load\n", static_cast<double>(self->readyTimestamp - LoadTimestamp) / 1e6);
+        else
+            snd_output_printf(out, ", not ready\n");
+        if (self->stream) {
+            snd_output_printf(out, "  API: %s\n", oboe::convertToText(self->stream->getAudioApi()));
+            if (self->capture)
+                snd_output_printf(out, "  Input preset: %s\n", oboe::convertToText(self->stream->getInputPreset()));
+            if (self->resampler)
+                snd_output_printf(out, "  Resampling: %uHz -> %uHz\n", ext->rate, self->streamRate);
+            snd_output_printf(out, "  Stream: %d channels, %s @ %dHz, burst %d frames, buffer %d/%d frames\n", self->stream->getChannelCount(), oboe::convertToText(self->stream->getFormat()), self->stream->getSampleRate(), self->stream->getFramesPerBurst(), self->stream->getBufferSizeInFrames(), self->stream->getBufferCapacityInFrames());
+        } else {
+            snd_output_printf(out, "  Stream: closed\n");
+        }
+
+        if (self->stream && self->latencyMilliseconds)
+            snd_output_printf(out, "  Latency: target %ums, achieved %lldms\n", self->latencyMilliseconds, static_cast<long long>(self->GetLatencyMilliseconds()));
+        if (self->capture)
+            snd_output_printf(out, "  Position: %llu frames captured, %llu frames read\n", static_cast<unsigned long long>(self->status.Read().hwPosition), static_cast<unsigned long long>(self->applPosition.load()));
+        else
+            snd_output_printf(out, "  Position: %llu frames written, %llu frames played\n", static_cast<unsigned long long>(self->applPosition.load()), static_cast<unsigned long long>(self->status.Read().hwPosition));
+        snd_output_printf(out, "  Ring: %s\n", self->running ? "running" : "stopped");
+        if (self->capture)
+            snd_output_printf(out, "  Overruns: %llu (%llu frames dropped)%s\n", static_cast<unsigned long long>(self->overruns.load(std::memory_order_relaxed)), static_cast<unsigned long long>(self->overrunFrames.load(std::memory_order_relaxed)), self->overrunXrun ? ", reported as xruns" : "");
+        else
+            snd_output_printf(out, "  Underruns: %llu\n", static_cast<unsigned long long>(self->underruns.load(std::memory_order_relaxed)));
+        snd_output_printf(out, "  Stalls: %llu\n", static_cast<unsigned long long>(self->stallRecoveries));
+        snd_output_printf(out, "  Missed deadlines: %llu\n", static_cast<unsigned long long>(self->deadlineRecoveries));
+        if (self->applicationTap)
+            snd_output_printf(out, "  Tap: %llu bytes dropped\n", static_cast<unsigned long long>(self->applicationTap->GetDroppedBytes() + (self->deviceTap ? self->deviceTap->GetDroppedBytes() : 0)));
+        if (OboePcm* partner{self->duplexPartner}) {
+            if (!self->capture) {
+                snd_output_printf(out, "  Duplex: output of %s, input %s\n", self->duplexGroup.c_str(), self->duplexInput.load() ? "attached" : "detached");
+            } else {
+                // The round trip is from the input of the device to its output through both rings, assuming the application passes input through as soon as it's read.
+                std::scoped_lock partnerLock{partner->mutex};
+                snd_output_printf(out, "  Duplex: input of %s, %llu frames dropped for drift", self->duplexGroup.c_str(), static_cast<unsigned long long>(self->driftDrops.load(std::memory_order_relaxed)));
+                if (self->stream && partner->stream) {
+                    auto inputLatency{self->stream->calculateLatencyMillis()};
+                    double input{inputLatency ? inputLatency.value() : static_cast<double>(self->stream->getFramesPerBurst()) * 1000.0 / self->stream->getSampleRate()};
+                    int64_t output{partner->GetLatencyMilliseconds()};
+                    snd_output_printf(out, ", round trip %.1fms (input %.1fms, output %lldms)\n", input + static_cast<double>(output), input, static_cast<long long>(output));
+                } else {
+                    snd_output_printf(out, "\n");
+                }
             }
+        }
+        for (unsigned int c{}; c < self->meter.GetChannels(); c++)
+            snd_output_printf(out, "  Channel %u: peak %.1f dBFS, RMS %.1f dBFS\n", c, 20.0f * std::log10(std::max(self->meter.GetPeak(c), 1e-5f)), 20.0f * std::log10(std::max(self->meter.GetRms(c), 1e-5f)));
+    }
 
-            int64_t framesWritten{self->stream->getFramesWritten()};
-            if (framesWritten < 0) {
-                std::cerr << "[ALSA Oboe] Failed to get frames written: " << framesWritten << std::endl;
-                return -1;
+    static snd_pcm_chmap_query_t** QueryChmaps(snd_pcm_ioplug_t* ext) {
+        constexpr unsigned int SupportedChannels[]{1, 2, 4, 6, 8};
+        auto** maps{static_cast<snd_pcm_chmap_query_t**>(calloc(std::size(SupportedChannels) + 1, sizeof(snd_pcm_chmap_query_t*)))};
+        if (!maps)
+            return nullptr;
+
+        for (size_t i{}; i < std::size(SupportedChannels); i++) {
+            std::vector<unsigned int> positions{GetChannelPositions(SupportedChannels[i])};
+            maps[i] = static_cast<snd_pcm_chmap_query_t*>(malloc(sizeof(snd_pcm_chmap_query_t) + positions.size() * sizeof(unsigned int)));
+            if (!maps[i]) {
+                snd_pcm_free_chmaps(maps);
+                return nullptr;
             }
 
-            if (framesRead == framesWritten)
-                break;
+            maps[i]->type = SND_CHMAP_TYPE_FIXED;
+            maps[i]->map.channels = positions.size();
+            std::copy(positions.begin(), positions.end(), maps[i]->map.pos);
+        }
+
+        return maps;
+    }
+
+    static snd_pcm_chmap_t* GetChmap(snd_pcm_ioplug_t* ext) {
+        std::vector<unsigned int> positions{GetChannelPositions(ext->channels)};
+        auto* map{static_cast<snd_pcm_chmap_t*>(malloc(sizeof(snd_pcm_chmap_t) + positions.size() * sizeof(unsigned int)))};
+        if (!map)
+            return nullptr;
+
+        map->channels = positions.size();
+        std::copy(positions.begin(), positions.end(), map->pos);
+        return map;
+    }
 
-            usleep(1000);
+    /**
+     * @brief Waits for the latest drain to complete, this must be called with the mutex held.
+     * @param lock The lock of the mutex, it's released while blocking so that other calls and the service thread aren't held up by the drain.
+     * @param block If the wait blocks, the drain is only checked on otherwise.
+     * @return 0 once the drain completed or was abandoned, -EAGAIN if it's still in progress while not blocking, -ETIMEDOUT if it missed its deadline or another negative error code.
+     * @note A stall during the drain is recovered from by the service thread, the drain then continues on the new stream.
+     */
+    int WaitForDrain(std::unique_lock<std::mutex>& lock, bool block) {
+        while (drainCompleted.load(std::memory_order_acquire) != drainsIssued) {
+            if (closing.load(std::memory_order_relaxed))
+                return -ECANCELED;
+            if (!draining)
+                return 0; // The ring was stopped by another thread in the meantime, which abandons the drain.
+            if (!stream)
+                return -EIO; // The stream couldn't be replaced after it stalled.
 
-            struct timespec now;
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            if ((now.tv_sec > start.tv_sec || (now.tv_sec == start.tv_sec && now.tv_nsec > start.tv_nsec)) && framesRead == 0) {
+            int64_t now{GetMonotonicNanoseconds()};
+            if (now > drainStart + oboe::kNanosPerSecond && stream->getFramesRead() == 0) {
                 // AAudio has a bug where it won't read any samples until an arbitrary minimum amount of samples have been written.
                 // We just wait for a second and if no samples have been read, we'll assume that AAudio is broken.
-                break;
+                return 0;
+            }
+
+            int64_t deadline{drainDeadline.load(std::memory_order_relaxed)};
+            if (now > deadline)
+                return -ETIMEDOUT;
+            if (!block)
+                return -EAGAIN;
+
+            struct pollfd descriptor{.fd = drainEventFd, .events = POLLIN};
+            int sliceMilliseconds{static_cast<int>(std::min<int64_t>((deadline - now) / 1000000 + 1, DrainSliceMilliseconds))};
+            lock.unlock();
+            if (poll(&descriptor, 1, sliceMilliseconds) > 0) {
+                eventfd_t value;
+                eventfd_read(drainEventFd, &value); // A signal of an abandoned drain can be pending as well, so the serial is checked regardless.
             }
+            lock.lock();
         }
+        return 0;
+    }
 
-        oboe::Result result{self->stream->requestStop()};
-        if (result != oboe::Result::OK) {
-            std::cerr << "[ALSA Oboe] Failed to stop stream: " << oboe::convertToText(result) << std::endl;
-            return -1;
+    static int Drain(snd_pcm_ioplug_t* ext) {
+        auto self{static_cast<OboePcm*>(ext->private_data)};
+        std::unique_lock lock{self->mutex};
+        if (!self->stream)
+            return -EBADFD;
+
+        if (self->capture) {
+            // A capture stops filling the ring on a drain, the application can still read all frames that have been captured up to this point.
+            self->StopRing(false);
+            self->drained = true;
+            return 0;
         }
 
-        oboe::StreamState state{self->stream->getState()};
-        while (state != oboe::StreamState::Stopped) {
-            result = self->stream->waitForStateChange(state, &state, TimeoutNanoseconds);
-            if (result != oboe::Result::OK) {
-                std::cerr << "[ALSA Oboe] Failed to wait for stop: " << oboe::convertToText(result) << std::endl;
-                return -1;
+        // pcm_ioplug keeps the PCM draining when we return -EAGAIN, the application calls us again to check on the drain that's already in progress.
+        if (!self->draining) {
+            uint64_t appl{self->applPosition.load()};
+            if (!self->running && appl == self->hwPosition.load()) {
+                self->drained = true;
+                return 0; // Nothing has been queued since the ring was stopped, the frames before that were already drained or dropped.
+            }
+            if (!self->running) {
+                // Writes below the start threshold don't start the stream, the frames that are queued still need to be played.
+                oboe::Result result{self->StartRing()};
+                if (result != oboe::Result::OK) {
+                    std::cerr << "[ALSA Oboe] Failed to start stream for drain: " << oboe::convertToText(result) << std::endl;
+                    return -1;
+                }
             }
+
+            // The data callback stops consuming exactly at the end of the ring, so running out of frames there isn't counted as an underrun.
+            // It then places an end marker after the last frame in the stream and signals us once the device has presented it, so the tail is never cut off.
+            self->PushCommand({.type = Command::Type::Drain, .position = appl, .serial = ++self->drainsIssued});
+            self->draining = true;
+
+            // The drain is bounded by the time that it takes to play the ring and the buffer of the stream, plus the time a transition is given to settle.
+            // Silence that's still pending ahead of the ring from the prefill or a scheduled start is played first, so it extends the bound as well.
+            self->drainStart = GetMonotonicNanoseconds();
+            self->drainTimeout = static_cast<int64_t>(appl - self->hwPosition.load(std::memory_order_acquire)) * oboe::kNanosPerSecond / self->plug.rate + self->GetTransitionTimeout();
+            self->drainTimeout += self->prefillFrames.load(std::memory_order_relaxed) * oboe::kNanosPerSecond / self->streamRate;
+            self->drainTimeout += std::max<int64_t>(self->startTarget.load(std::memory_order_acquire) - self->drainStart, 0);
+            self->drainDeadline.store(self->drainStart + self->drainTimeout, std::memory_order_relaxed);
+        }
+
+        int err{self->WaitForDrain(lock, !ext->nonblock)};
+        if (!self->draining)
+            return 0; // The drain was abandoned by a drop from another thread, which already stopped the ring.
+        if (err == -EAGAIN) {
+            // The application polls for the completion of the drain, see PollRevents.
+            self->pendingDrainSerial.store(self->drainsIssued, std::memory_order_release);
+            return err;
+        }
+        if (err == -ETIMEDOUT) {
+            // Whatever wasn't played by now is dropped, the stream is replaced by the service thread as one that doesn't drain can't be trusted with the next start.
+            // The drain is failed regardless of the rebuild, as the application needs to know that the end of its audio was lost.
+            std::cerr << "[ALSA Oboe] Drain didn't complete within " << self->drainTimeout / 1000000 << "ms, rebuilding stream" << std::endl;
+            self->deadlineRecoveries++;
+            self->reopenWanted = true;
+            self->StopRing(true);
+            self->SyncCommands(); // The data callback of the old stream may never apply the commands.
+            return -EIO;
         }
+        if (err < 0)
+            return err;
 
+        // The service thread stops the stream once it has been idle for the idle timeout, which lets a following start skip the round trip to the device.
+        self->StopRing(false);
+        self->drained = true;
         return 0;
     }
 
@@ -272,31 +3224,147 @@ class OboePcm {
         if (!self->stream)
             return -EBADFD;
 
-        oboe::Result result{self->stream->requestPause()};
+        // The audio is faded out and back in rather than being cut off, the frames played during the fade out are consumed from the ring as usual.
+        if (enable) {
+            self->StopRing(false, !self->capture);
+            return 0;
+        }
+
+        oboe::Result result{self->StartRing(true)};
         if (result != oboe::Result::OK) {
-            std::cerr << "[ALSA Oboe] Failed to pause stream: " << oboe::convertToText(result) << std::endl;
+            std::cerr << "[ALSA Oboe] Failed to resume stream: " << oboe::convertToText(result) << std::endl;
             return -1;
         }
 
         return 0;
     }
 
+    static int SwParams(snd_pcm_ioplug_t* ext, snd_pcm_sw_params_t* params) {
+        auto self{static_cast<OboePcm*>(ext->private_data)};
+        std::scoped_lock lock{self->mutex};
+
+        int err{snd_pcm_sw_params_get_boundary(params, &self->boundary)};
+        if (err < 0)
+            return err;
+
+        err = snd_pcm_sw_params_get_avail_min(params, &self->availMin);
+        if (err < 0)
+            return err;
+
+        int periodEvent;
+        err = snd_pcm_sw_params_get_period_event(params, &periodEvent);
+        if (err < 0)
+            return err;
+        self->periodEvent = periodEvent;
+
+        return 0;
+    }
+
+    static int PollRevents(snd_pcm_ioplug_t* ext, struct pollfd* pfds, unsigned int nfds, unsigned short* revents) {
+        auto self{static_cast<OboePcm*>(ext->private_data)};
+        if (nfds != 1 || pfds[0].fd != self->eventFd)
+            return -EINVAL;
+        self->ApplyLinkedState();
+
+        // The eventfd is cleared prior to checking the available space, if there's still enough space then it's signalled again.
+        // This ensures the descriptor is level-triggered like a kernel PCM and we can't lose a wakeup from the data callback in between.
+        // A pending period event is edge-triggered however, it's consumed by the poll that reports it as ALSA would with a hardware PCM.
+        eventfd_t value;
+        eventfd_read(self->eventFd, &value);
+        unsigned short ready{static_cast<unsigned short>(self->capture ? POLLIN : POLLOUT)};
+
+        // A non-blocking drain is polled for its completion rather than for space in the ring, it's reported ready once the application needs to call drain again.
+        if (uint32_t drain{self->pendingDrainSerial.load(std::memory_order_acquire)}) {
+            if (self->drainCompleted.load(std::memory_order_acquire) == drain || GetMonotonicNanoseconds() > self->drainDeadline.load(std::memory_order_relaxed)) {
+                self->Notify();
+                *revents = ready;
+            } else {
+                *revents = 0;
+            }
+            return 0;
+        }
+
+        bool periodElapsed{self->periodEventPending.exchange(false, std::memory_order_acquire)};
+        if (self->GetAvail() >= self->availMin) {
+            self->Notify();
+            *revents = ready;
+        } else {
+            *revents = periodElapsed ? ready : 0;
+        }
+
+        return 0;
+    }
+
+    /**
+     * @return The arguments of callbacks that take none for the trace, these are the hardware parameters as they're what a prepare depends on.
+     * @note The result of the callback is supplied to every overload, outputs are only written by callbacks that succeed so they're recorded as 0 otherwise.
+     */
+    static std::array<uint64_t, 2> GetTraceArguments(int64_t, snd_pcm_ioplug_t* ext) {
+        return {static_cast<uint64_t>(ext->format) | ext->channels << 8 | static_cast<uint64_t>(ext->access) << 16 | static_cast<uint64_t>(ext->rate) << 32, ext->buffer_size | static_cast<uint64_t>(ext->period_size) << 32};
+    }
+
+    static std::array<uint64_t, 2> GetTraceArguments(int64_t, snd_pcm_ioplug_t*, const snd_pcm_channel_area_t*, snd_pcm_uframes_t offset, snd_pcm_uframes_t size) {
+        return {size, offset};
+    }
+
+    static std::array<uint64_t, 2> GetTraceArguments(int64_t, snd_pcm_ioplug_t* ext, snd_pcm_sw_params_t*) {
+        auto* self{static_cast<OboePcm*>(ext->private_data)};
+        return {self->availMin, self->periodEvent};
+    }
+
+    static std::array<uint64_t, 2> GetTraceArguments(int64_t, snd_pcm_ioplug_t*, int enable) {
+        return {static_cast<uint64_t>(enable), 0};
+    }
+
+    static std::array<uint64_t, 2> GetTraceArguments(int64_t result, snd_pcm_ioplug_t*, struct pollfd*, unsigned int, unsigned short* revents) {
+        return {result >= 0 ? *revents : 0U, 0};
+    }
+
+    static std::array<uint64_t, 2> GetTraceArguments(int64_t result, snd_pcm_ioplug_t*, snd_pcm_sframes_t* delayp) {
+        return {result >= 0 ? static_cast<uint64_t>(*delayp) : 0, 0};
+    }
+
+    /**
+     * @brief Invokes a callback and records it into the trace of the PCM if it's being traced, the arguments are gathered after the callback so outputs of successful calls are included.
+     */
+    template <trace::Event Event, auto Function, typename... Args>
+    static auto Traced(snd_pcm_ioplug_t* ext, Args... args) -> decltype(Function(ext, args...)) {
+        auto* self{static_cast<OboePcm*>(ext->private_data)};
+        if (!self->trace)
+            return Function(ext, args...);
+
+        int64_t start{GetMonotonicNanoseconds()};
+        auto result{Function(ext, args...)};
+        self->trace->Record(Event, start, result, GetTraceArguments(result, ext, args...));
+        return result;
+    }
+
+    // Note: Close isn't traced as it destroys the instance, a trace implicitly ends with it.
     constexpr static snd_pcm_ioplug_callback_t Callbacks{
-        .start = &Start,
-        .stop = &Stop,
-        .pointer = &Pointer,
-        .transfer = &Transfer,
+        .start = &Traced<trace::Event::Start, &Start>,
+        .stop = &Traced<trace::Event::Stop, &Stop>,
+        .pointer = &Traced<trace::Event::Pointer, &Pointer>,
+        .transfer = &Traced<trace::Event::Transfer, &Transfer>,
         .close = &Close,
-        .prepare = &Prepare,
-        .drain = &Drain,
-        .pause = &Pause,
-        .resume = &Start,
+        .hw_free = &Traced<trace::Event::HwFree, &HwFree>,
+        .sw_params = &Traced<trace::Event::SwParams, &SwParams>,
+        .prepare = &Traced<trace::Event::Prepare, &Prepare>,
+        .drain = &Traced<trace::Event::Drain, &Drain>,
+        .pause = &Traced<trace::Event::Pause, &Pause>,
+        .resume = &Traced<trace::Event::Resume, &Start>,
+        .poll_revents = &Traced<trace::Event::PollRevents, &PollRevents>,
+        .dump = &Dump,
+        .delay = &Traced<trace::Event::Delay, &Delay>,
+        .query_chmaps = &QueryChmaps,
+        .get_chmap = &GetChmap,
     };
 
   public:
     snd_pcm_ioplug_t plug{
         .version = SND_PCM_IOPLUG_VERSION,
         .name = "ALSA <-> Oboe PCM I/O Plugin",
+        .flags = SND_PCM_IOPLUG_FLAG_BOUNDARY_WA | SND_PCM_IOPLUG_FLAG_MONOTONIC, // Pointer reports the position wrapped at the boundary rather than the buffer size.
+        .poll_events = POLLIN,
         .mmap_rw = false,
         .callback = &Callbacks,
         .private_data = this,
@@ -304,9 +3372,20 @@ class OboePcm {
 
     OboePcm() = default;
 
-    int Initialize(const char* name, snd_pcm_stream_t stream, int mode) {
-        if (stream != SND_PCM_STREAM_PLAYBACK)
-            return -EINVAL; // We only support playback for now.
+    /**
+     * @param openTimestamp The time at which the application started opening the PCM.
+     */
+    int Initialize(const char* name, snd_pcm_stream_t stream, int mode, const OboePcmConfig& config, int64_t openTimestamp) {
+        this->openTimestamp = openTimestamp;
+        capture = stream == SND_PCM_STREAM_CAPTURE;
+
+        eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventFd < 0)
+            return -errno;
+        plug.poll_fd = eventFd;
+        drainEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (drainEventFd < 0)
+            return -errno;
 
         int err{snd_pcm_ioplug_create(&plug, name, stream, mode)};
         if (err < 0)
@@ -316,7 +3395,7 @@ class OboePcm {
             return snd_pcm_ioplug_set_param_list(io, type, list.size(), list.begin());
         }};
 
-        err = setParamList(SND_PCM_IOPLUG_HW_ACCESS, {SND_PCM_ACCESS_RW_INTERLEAVED});
+        err = setParamList(SND_PCM_IOPLUG_HW_ACCESS, {SND_PCM_ACCESS_RW_INTERLEAVED, SND_PCM_ACCESS_RW_NONINTERLEAVED});
         if (err < 0)
             return err;
 
@@ -329,8 +3408,8 @@ class OboePcm {
         if (err < 0)
             return err;
 
-        // We could support more than 2 channels, but it's fairly complicated due to channel mappings.
-        err = snd_pcm_ioplug_set_param_minmax(&plug, SND_PCM_IOPLUG_HW_CHANNELS, 1, 2);
+        // Only the standard channel layouts are supported, as these are the only ones which we know how to mix into the layout of the device.
+        err = setParamList(SND_PCM_IOPLUG_HW_CHANNELS, {1, 2, 4, 6, 8});
         if (err < 0)
             return err;
 
@@ -340,32 +3419,358 @@ class OboePcm {
             return err;
 
         // Oboe will decide the period/buffer size internally after starting the stream and it's not a detail that we can expose properly.
-        // We set arbitrary values that should be reasonable for most use cases.
+        // We set arbitrary values that should be reasonable for most use cases, unless a latency target has been configured.
         err = snd_pcm_ioplug_set_param_minmax(&plug, SND_PCM_IOPLUG_HW_PERIODS, 2, 4);
         if (err < 0)
             return err;
-        err = snd_pcm_ioplug_set_param_minmax(&plug, SND_PCM_IOPLUG_HW_BUFFER_BYTES, 32 * 1024, 64 * 1024);
+        unsigned int minBufferBytes{32 * 1024}, maxBufferBytes{64 * 1024};
+        if (config.latencyMilliseconds) {
+            // pcm_ioplug can only constrain the buffer in bytes, these are derived for the 48kHz 16-bit stereo that Android mixes at.
+            // Three quarters of the target are given to the ring, the remainder is covered by the buffer of the stream which is sized at prepare once the frame rate is known.
+            constexpr unsigned int ReferenceBytesPerMillisecond{48 * 2 * 2};
+            maxBufferBytes = std::max(config.latencyMilliseconds * 3 / 4 * ReferenceBytesPerMillisecond, 512U);
+            minBufferBytes = maxBufferBytes / 2;
+        }
+
+        // Buffers that the device is known to cap are excluded up front, so applications settle on a size that a stream can actually be opened with.
+        // This is derived for the same reference format as above, a stream at a fixed device rate doesn't request a capacity so it isn't limited by this.
+        if (!config.capabilityCache.empty())
+            CapabilityCache::Load(config.capabilityCache);
+        if (capture || !config.deviceRate) {
+            constexpr unsigned int ReferenceBytesPerFrame{2 * 2};
+            if (int32_t limit{CapabilityCache::GetCapacityLimit(capture ? oboe::Direction::Input : oboe::Direction::Output, 48000)}) {
+                maxBufferBytes = std::max(std::min(maxBufferBytes, static_cast<unsigned int>(limit) * ReferenceBytesPerFrame), 512U);
+                minBufferBytes = std::min(minBufferBytes, maxBufferBytes / 2);
+            }
+        }
+        err = snd_pcm_ioplug_set_param_minmax(&plug, SND_PCM_IOPLUG_HW_BUFFER_BYTES, minBufferBytes, maxBufferBytes);
         if (err < 0)
             return err;
+        latencyMilliseconds = config.latencyMilliseconds;
+        prefillBursts = config.prefillBursts;
+
+        configuredChannels = config.deviceChannels;
+        deviceRate = capture ? 0 : config.deviceRate; // Capture is always converted by Oboe, see OpenStream.
+        watchdogTimeout = static_cast<int64_t>(config.watchdogMilliseconds) * 1000000;
+        transitionTimeout = static_cast<int64_t>(config.transitionTimeoutMilliseconds) * 1000000;
+        idleTimeout = static_cast<int64_t>(config.idleTimeoutMilliseconds) * 1000000;
+        overrunXrun = capture && config.overrunXrun;
+        inputPreset = config.inputPreset;
+        tapDirectory = config.tapDirectory;
+        tapDevice = config.tapDevice;
+        if (!config.traceFile.empty())
+            trace = TraceRecorder::Create(config.traceFile, stream, mode, openTimestamp);
+
+        std::scoped_lock lock{instancesMutex};
+        instances.push_back(this);
+        for (unsigned int slot{}; slot < MeterSlots; slot++) {
+            if (!meterSlots[slot]) {
+                meterSlots[slot] = this;
+                meterSlot = static_cast<int>(slot);
+                break;
+            }
+        }
+        if (!config.linkGroup.empty()) {
+            auto& namedGroup{namedLinkGroups[config.linkGroup]};
+            std::shared_ptr<LinkGroup> group{namedGroup.lock()};
+            if (!group) {
+                group = std::make_shared<LinkGroup>();
+                namedGroup = group;
+            }
+            JoinGroup(group);
+        }
+        if (!config.duplexGroup.empty()) {
+            duplexGroup = config.duplexGroup;
+            for (OboePcm* instance : instances) {
+                if (instance != this && instance->duplexGroup == duplexGroup && instance->capture != capture && !instance->duplexPartner) {
+                    std::scoped_lock pairLock{instance->mutex, mutex};
+                    instance->duplexPartner = this;
+                    duplexPartner = instance;
+                    break;
+                }
+            }
+        }
 
+        openedTimestamp = GetMonotonicNanoseconds();
         return 0;
     }
 
-    ~OboePcm() {
+    /**
+     * @brief Removes this instance from its group, this must be called with instancesMutex held.
+     */
+    void LeaveGroup() {
+        if (!linkGroup)
+            return;
+
+        std::shared_ptr<LinkGroup> group{linkGroup};
+        {
+            std::scoped_lock groupLock{group->mutex};
+            std::scoped_lock lock{mutex};
+            group->members.erase(std::remove(group->members.begin(), group->members.end(), this), group->members.end());
+            linkGroup.reset();
+        }
+        group.reset();
+
+        // A named group is only referenced by its members, so its name is released along with the last of them.
+        for (auto it{namedLinkGroups.begin()}; it != namedLinkGroups.end();) {
+            if (it->second.expired())
+                it = namedLinkGroups.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    /**
+     * @brief Dissolves the duplex pair of this instance, this must be called with instancesMutex held.
+     * @note A paired input stream stops receiving input until it's reopened, which happens on the next prepare or once the watchdog rebuilds it.
+     */
+    void LeaveDuplex() {
+        OboePcm* partner{duplexPartner};
+        if (!partner)
+            return;
+
+        std::scoped_lock lock{partner->mutex, mutex};
+        (capture ? this : partner)->DetachInput();
+        partner->duplexPartner = nullptr;
+        duplexPartner = nullptr;
+    }
+
+    /**
+     * @brief Moves this instance into the supplied group, this must be called with instancesMutex held.
+     */
+    void JoinGroup(const std::shared_ptr<LinkGroup>& group) {
+        LeaveGroup();
+
+        std::scoped_lock groupLock{group->mutex};
         std::scoped_lock lock{mutex};
-        stream.reset();
+        group->members.push_back(this);
+        linkGroup = group;
+    }
+
+    /**
+     * @brief Links the second PCM to the group of the first one with the same semantics as snd_pcm_link(), a group is created if the first PCM isn't linked yet.
+     */
+    static int Link(snd_pcm_t* pcm1, snd_pcm_t* pcm2) {
+        std::scoped_lock lock{instancesMutex};
+        auto find{[](snd_pcm_t* pcm) {
+            auto it{std::find_if(instances.begin(), instances.end(), [pcm](OboePcm* instance) { return instance->plug.pcm == pcm; })};
+            return it != instances.end() ? *it : nullptr;
+        }};
+
+        OboePcm *first{find(pcm1)}, *second{find(pcm2)};
+        if (!first || !second)
+            return -ENODEV;
+        if (first == second)
+            return -EINVAL;
+
+        if (!first->linkGroup)
+            first->JoinGroup(std::make_shared<LinkGroup>());
+        if (second->linkGroup != first->linkGroup)
+            second->JoinGroup(first->linkGroup);
+        return 0;
+    }
+
+    /**
+     * @brief Removes a PCM from its group with the same semantics as snd_pcm_unlink().
+     */
+    static int Unlink(snd_pcm_t* pcm) {
+        std::scoped_lock lock{instancesMutex};
+        for (OboePcm* instance : instances) {
+            if (instance->plug.pcm == pcm) {
+                instance->LeaveGroup();
+                return 0;
+            }
+        }
+        return -ENODEV;
+    }
+
+    /**
+     * @brief Looks up the instance backing an ALSA handle and runs the supplied function on it with its mutex held.
+     * @return The result of the function or -ENODEV if the handle doesn't belong to this plugin.
+     */
+    template <typename Function>
+    static int WithInstance(snd_pcm_t* pcm, Function function) {
+        std::scoped_lock lock{instancesMutex};
+        for (OboePcm* instance : instances) {
+            if (instance->plug.pcm == pcm) {
+                std::scoped_lock instanceLock{instance->mutex};
+                return function(*instance);
+            }
+        }
+        return -ENODEV;
+    }
+
+    /**
+     * @brief Reads the levels of the instance in the supplied meter slot as linear values in the range of [0, 1], channels without a level are zeroed.
+     * @param rms If the RMS levels should be read rather than the peak levels.
+     */
+    static void ReadMeterSlot(unsigned int slot, bool rms, float (&levels)[LevelMeter::MaxChannels]) {
+        std::scoped_lock lock{instancesMutex};
+        std::fill(std::begin(levels), std::end(levels), 0.0f);
+
+        OboePcm* instance{meterSlots[slot]};
+        if (!instance)
+            return;
+
+        for (unsigned int c{}; c < instance->meter.GetChannels(); c++)
+            levels[c] = rms ? instance->meter.GetRms(c) : instance->meter.GetPeak(c);
+    }
+
+    /**
+     * @brief Schedules the next start to present its first frame at the supplied CLOCK_MONOTONIC time, this must be called with the mutex held.
+     */
+    void ScheduleStart(int64_t timestamp) {
+        scheduledStart = timestamp;
+    }
+
+    /**
+     * @return The CLOCK_MONOTONIC time in nanoseconds at which the first frame after the last start was presented, or is expected to be.
+     */
+    int64_t GetTriggerTimestamp() const {
+        return triggerTimestamp.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Retrieves the CLOCK_MONOTONIC time in nanoseconds at which the next frame that will be read from the capture ring was captured, this must be called with the mutex held.
+     * @return 0 on success, -EINVAL if the PCM isn't a prepared capture PCM or -EAGAIN if there's no frame to read.
+     */
+    int GetCaptureTimestamp(int64_t& timestamp) const {
+        if (!capture || !periodTimestamps)
+            return -EINVAL;
+
+        uint64_t appl{applPosition.load(std::memory_order_acquire)};
+        if (hwPosition.load(std::memory_order_acquire) == appl)
+            return -EAGAIN;
+
+        // The frame is timestamped relative to the start of its period, as the position of the ring directly maps onto the timeline of the device within a period.
+        snd_pcm_uframes_t periodSize{plug.period_size};
+        timestamp = periodTimestamps[appl / periodSize % periodCount].load(std::memory_order_relaxed) + static_cast<int64_t>(appl % periodSize) * oboe::kNanosPerSecond / plug.rate;
+        return 0;
+    }
+
+    ~OboePcm() {
+        closing.store(true, std::memory_order_relaxed); // A drain that's being waited on is abandoned, so we don't block on it below.
+        {
+            std::scoped_lock lock{instancesMutex};
+            instances.erase(std::remove(instances.begin(), instances.end(), this), instances.end());
+            if (meterSlot >= 0)
+                meterSlots[meterSlot] = nullptr;
+            LeaveGroup();
+            LeaveDuplex();
+        }
+        {
+            // The data callback references this object, so the stream is detached from it here. It's closed by the service thread prior to that exiting.
+            std::scoped_lock lock{mutex};
+            RetireStream();
+        }
+        if (serviceAcquired)
+            ReleaseService();
+
+        if (eventFd >= 0)
+            close(eventFd);
+        if (drainEventFd >= 0)
+            close(drainEventFd);
     }
 };
 
+/**
+ * @brief An ALSA control plugin that exposes the levels measured by the Oboe PCMs in the process as read-only controls.
+ * @note This is built into the same library as the PCM plugin as it needs to share its state, the library is installed under the name of the control plugin too.
+ */
+class OboeCtl {
+  private:
+    constexpr static const char* ElementNames[]{"Oboe Peak Level", "Oboe RMS Level"}; //!< The names of the elements of each meter slot, the index of an element is its slot.
+    constexpr static long MaxLevel{32767}; //!< The value of a full scale level, levels are reported linearly.
+
+    static int ElemCount(snd_ctl_ext_t* ext) {
+        return OboePcm::MeterSlots * std::size(ElementNames);
+    }
+
+    static int ElemList(snd_ctl_ext_t* ext, unsigned int offset, snd_ctl_elem_id_t* id) {
+        snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
+        snd_ctl_elem_id_set_name(id, ElementNames[offset % std::size(ElementNames)]);
+        snd_ctl_elem_id_set_index(id, offset / std::size(ElementNames));
+        return 0;
+    }
+
+    static snd_ctl_ext_key_t FindElem(snd_ctl_ext_t* ext, const snd_ctl_elem_id_t* id) {
+        unsigned int index{snd_ctl_elem_id_get_index(id)};
+        if (index >= OboePcm::MeterSlots)
+            return SND_CTL_EXT_KEY_NOT_FOUND;
+
+        const char* name{snd_ctl_elem_id_get_name(id)};
+        for (size_t i{}; i < std::size(ElementNames); i++)
+            if (std::strcmp(name, ElementNames[i]) == 0)
+                return index * std::size(ElementNames) + i;
+        return SND_CTL_EXT_KEY_NOT_FOUND;
+    }
+
+    static int GetAttribute(snd_ctl_ext_t* ext, snd_ctl_ext_key_t key, int* type, unsigned int* acc, unsigned int* count) {
+        *type = SND_CTL_ELEM_TYPE_INTEGER;
+        *acc = SND_CTL_EXT_ACCESS_READ | SND_CTL_EXT_ACCESS_VOLATILE;
+        *count = LevelMeter::MaxChannels;
+        return 0;
+    }
+
+    static int GetIntegerInfo(snd_ctl_ext_t* ext, snd_ctl_ext_key_t key, long* imin, long* imax, long* istep) {
+        *imin = 0;
+        *imax = MaxLevel;
+        *istep = 1;
+        return 0;
+    }
+
+    static int ReadInteger(snd_ctl_ext_t* ext, snd_ctl_ext_key_t key, long* value) {
+        float levels[LevelMeter::MaxChannels];
+        OboePcm::ReadMeterSlot(key / std::size(ElementNames), key % std::size(ElementNames) == 1, levels);
+        for (unsigned int c{}; c < LevelMeter::MaxChannels; c++)
+            value[c] = std::lround(std::min(levels[c], 1.0f) * MaxLevel);
+        return 0;
+    }
+
+    static void Close(snd_ctl_ext_t* ext) {
+        delete static_cast<OboeCtl*>(ext->private_data);
+    }
+
+    constexpr static snd_ctl_ext_callback_t Callbacks{
+        .close = &Close,
+        .elem_count = &ElemCount,
+        .elem_list = &ElemList,
+        .find_elem = &FindElem,
+        .get_attribute = &GetAttribute,
+        .get_integer_info = &GetIntegerInfo,
+        .read_integer = &ReadInteger,
+    };
+
+  public:
+    snd_ctl_ext_t ext{
+        .version = SND_CTL_EXT_VERSION,
+        .card_idx = -1,
+        .id = "oboe",
+        .driver = "Oboe",
+        .name = "Oboe",
+        .longname = "ALSA <-> Oboe Control Plugin",
+        .mixername = "Oboe",
+        .poll_fd = -1,
+        .callback = &Callbacks,
+        .private_data = this,
+    };
+};
+
+// The library is built with hidden visibility, only the plugin entry points and the public API are exported from it.
+#pragma GCC visibility push(default)
 extern "C" {
 SND_PCM_PLUGIN_DEFINE_FUNC(oboe) {
-    // Note: We don't need to do anything with the config, so we can just ignore it.
+    int64_t openTimestamp{GetMonotonicNanoseconds()};
+    OboePcmConfig config;
+    int err{config.Parse(conf)};
+    if (err < 0)
+        return err;
 
     OboePcm* plugin{new (std::nothrow) OboePcm{}};
     if (!plugin)
         return -ENOMEM;
 
-    int err{plugin->Initialize(name, stream, mode)};
+    err = plugin->Initialize(name, stream, mode, config, openTimestamp);
     if (err < 0) {
         delete plugin;
         return err;
@@ -376,4 +3781,68 @@ SND_PCM_PLUGIN_DEFINE_FUNC(oboe) {
 }
 
 SND_PCM_PLUGIN_SYMBOL(oboe);
-}
\ No newline at end of file
+
+SND_CTL_PLUGIN_DEFINE_FUNC(oboe) {
+    OboeCtl* plugin{new (std::nothrow) OboeCtl{}};
+    if (!plugin)
+        return -ENOMEM;
+
+    int err{snd_ctl_ext_create(&plugin->ext, name, mode)};
+    if (err < 0) {
+        delete plugin;
+        return err;
+    }
+
+    *handlep = plugin->ext.handle;
+    return 0;
+}
+
+SND_CTL_PLUGIN_SYMBOL(oboe);
+
+int snd_pcm_oboe_set_start_time(snd_pcm_t* pcm, const snd_htimestamp_t* tstamp) {
+    if (!tstamp)
+        return -EINVAL;
+
+    int64_t timestamp{static_cast<int64_t>(tstamp->tv_sec) * oboe::kNanosPerSecond + tstamp->tv_nsec};
+    return OboePcm::WithInstance(pcm, [timestamp](OboePcm& instance) {
+        instance.ScheduleStart(timestamp);
+        return 0;
+    });
+}
+
+int snd_pcm_oboe_link(snd_pcm_t* pcm1, snd_pcm_t* pcm2) {
+    return OboePcm::Link(pcm1, pcm2);
+}
+
+int snd_pcm_oboe_unlink(snd_pcm_t* pcm) {
+    return OboePcm::Unlink(pcm);
+}
+
+int snd_pcm_oboe_get_capture_tstamp(snd_pcm_t* pcm, snd_htimestamp_t* tstamp) {
+    if (!tstamp)
+        return -EINVAL;
+
+    return OboePcm::WithInstance(pcm, [tstamp](OboePcm& instance) {
+        int64_t timestamp;
+        int err{instance.GetCaptureTimestamp(timestamp)};
+        if (err < 0)
+            return err;
+        tstamp->tv_sec = timestamp / oboe::kNanosPerSecond;
+        tstamp->tv_nsec = timestamp % oboe::kNanosPerSecond;
+        return 0;
+    });
+}
+
+int snd_pcm_oboe_get_trigger_tstamp(snd_pcm_t* pcm, snd_htimestamp_t* tstamp) {
+    if (!tstamp)
+        return -EINVAL;
+
+    return OboePcm::WithInstance(pcm, [tstamp](OboePcm& instance) {
+        int64_t timestamp{instance.GetTriggerTimestamp()};
+        tstamp->tv_sec = timestamp / oboe::kNanosPerSecond;
+        tstamp->tv_nsec = timestamp % oboe::kNanosPerSecond;
+        return 0;
+    });
+}
+}
+#pragma GCC visibility pop
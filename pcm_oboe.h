@@ -0,0 +1,55 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright © 2024 Cassia Team (https://github.com/cassia-org)
+ */
+
+#pragma once
+
+#include <alsa/asoundlib.h>
+
+/**
+ * @brief Extensions to the ALSA API that are specific to Oboe PCMs.
+ * @note The plugin is loaded by alsa-lib with local symbol visibility, these functions need to be resolved via dlsym() on a handle to the plugin library.
+ *       The handle can be obtained without loading the library again with dlopen("libasound_module_pcm_oboe.so", RTLD_NOW | RTLD_NOLOAD).
+ * @note The supplied PCM must be the Oboe PCM itself, not a PCM that uses it as a slave. All functions return -ENODEV otherwise.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Schedules the next start of the PCM so that its first frame is presented by the device at the supplied CLOCK_MONOTONIC time.
+ * @note The stream is started as usual, the plugin pads the output with silence based on the stream's latency estimate until the target time.
+ *       If the target time has already passed by the time the stream starts, playback starts immediately.
+ */
+int snd_pcm_oboe_set_start_time(snd_pcm_t* pcm, const snd_htimestamp_t* tstamp);
+
+/**
+ * @brief Retrieves the CLOCK_MONOTONIC time at which the first frame after the last start was presented, or is expected to be.
+ * @note alsa-lib fills in the trigger_tstamp of snd_pcm_status_t itself at the time of snd_pcm_start(), which doesn't account for the device latency or a scheduled start.
+ */
+int snd_pcm_oboe_get_trigger_tstamp(snd_pcm_t* pcm, snd_htimestamp_t* tstamp);
+
+/**
+ * @brief Retrieves the CLOCK_MONOTONIC time at which the next frame that will be read from a capture PCM was captured by the device.
+ * @note The capture time of every period is recorded as it's written by the device, this is the time of the period that contains the frame advanced to the frame itself.
+ * @return 0 on success, -EINVAL if the PCM isn't a prepared capture PCM or -EAGAIN if there is no captured frame to read.
+ */
+int snd_pcm_oboe_get_capture_tstamp(snd_pcm_t* pcm, snd_htimestamp_t* tstamp);
+
+/**
+ * @brief Links two PCMs so that they start and stop together, this is equivalent to snd_pcm_link() which isn't supported by I/O plugins.
+ * @note Linked PCMs are started at the same time via a scheduled start, their first frames are presented by the device at the same time.
+ * @note PCMs can also be linked via the link_group option in their configuration, all PCMs with the same group name are linked.
+ */
+int snd_pcm_oboe_link(snd_pcm_t* pcm1, snd_pcm_t* pcm2);
+
+/**
+ * @brief Removes a PCM from the group it has been linked to, this is equivalent to snd_pcm_unlink().
+ */
+int snd_pcm_oboe_unlink(snd_pcm_t* pcm);
+
+#ifdef __cplusplus
+}
+#endif
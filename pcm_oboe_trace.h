@@ -0,0 +1,55 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright © 2024 Cassia Team (https://github.com/cassia-org)
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief The format of the traces of ioplug callbacks that are recorded by the plugin with the trace_file option and replayed by tools/oboe_replay.
+ * @note A trace is a TraceHeader followed by a TraceRecord for every callback in the order they returned, all fields are in the native byte order.
+ */
+namespace trace {
+    constexpr char Magic[4]{'O', 'B', 'T', 'R'};
+    constexpr uint32_t Version{1};
+
+    struct TraceHeader {
+        char magic[4];
+        uint32_t version;
+        uint32_t stream; //!< The snd_pcm_stream_t of the PCM.
+        uint32_t mode; //!< The mode that the PCM was opened with, such as SND_PCM_NONBLOCK.
+    };
+
+    enum class Event : uint16_t {
+        Start,
+        Stop,
+        Pointer,
+        Transfer, //!< arguments: {size, offset}, result: the amount of frames transferred.
+        Prepare, //!< arguments: {format | channels << 8 | access << 16 | rate << 32, buffer_size | period_size << 32}.
+        HwFree,
+        SwParams, //!< arguments: {avail_min, period_event}.
+        Drain,
+        Pause, //!< arguments: {enable}.
+        Resume,
+        PollRevents, //!< arguments: {revents}.
+        Delay, //!< arguments: {delay}.
+        Count,
+    };
+
+    struct TraceRecord {
+        int64_t timestamp; //!< The time at which the callback was entered in nanoseconds, relative to the PCM being opened.
+        uint32_t duration; //!< The time spent in the callback in microseconds, saturated at UINT32_MAX.
+        Event event;
+        uint16_t reserved;
+        int64_t result; //!< The return value of the callback.
+        uint64_t arguments[2]; //!< The arguments of the callback, see the documentation of each event.
+    };
+    static_assert(sizeof(TraceRecord) == 40, "Traces are read back with the same layout on every architecture");
+
+    inline const char* ToString(Event event) {
+        constexpr const char* Names[]{"start", "stop", "pointer", "transfer", "prepare", "hw_free", "sw_params", "drain", "pause", "resume", "poll_revents", "delay"};
+        return event < Event::Count ? Names[static_cast<uint16_t>(event)] : "unknown";
+    }
+}
@@ -0,0 +1,309 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright © 2024 Cassia Team (https://github.com/cassia-org)
+ */
+
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <time.h>
+#include "pcm_oboe_trace.h"
+
+#include <algorithm>
+#include <array>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Replays a trace recorded with the trace_file option against the plugin running on the simulated Oboe backend, with the timing of the recording.
+ * @note Every callback in the trace is reproduced with the ALSA call that leads to it, so the state machine of pcm_ioplug is exercised like it was during the recording.
+ *       ALSA invokes some callbacks on its own as part of other calls (such as pointer during a transfer), these show up as additional calls in the replay.
+ */
+
+/**
+ * @brief The entry point of the plugin, it's linked in directly rather than loaded by alsa-lib so that it runs against the simulated backend.
+ */
+extern "C" int _snd_pcm_oboe_open(snd_pcm_t** pcmp, const char* name, snd_config_t* root, snd_config_t* conf, snd_pcm_stream_t stream, int mode);
+
+static int64_t GetMonotonicNanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @return The value at the supplied percentile of the samples, the samples are sorted in place.
+ */
+static int64_t GetPercentile(std::vector<int64_t>& samples, double percentile) {
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(static_cast<size_t>(static_cast<double>(samples.size()) * percentile), samples.size() - 1)];
+}
+
+class Replayer {
+  private:
+    snd_pcm_t* pcm;
+    snd_pcm_stream_t stream;
+    uint64_t hwParams[2]{}; //!< The packed hardware parameters that are currently applied, zero if there are none.
+    snd_pcm_access_t access{};
+    unsigned int channels{};
+    size_t frameSize{};
+    std::vector<uint8_t> buffer; //!< The audio that's transferred, this is always silence.
+
+    struct EventStatistics {
+        std::vector<int64_t> durations; //!< The durations of the calls during the replay in nanoseconds.
+        uint64_t recordedDuration{}; //!< The total duration of the callbacks during the recording in microseconds.
+        uint32_t recordedMaximum{}; //!< The longest callback during the recording in microseconds.
+        uint64_t divergences{}; //!< The amount of calls that failed during the replay but not the recording or vice versa.
+    };
+    std::array<EventStatistics, static_cast<size_t>(trace::Event::Count)> statistics;
+    std::vector<int64_t> lateness; //!< How late every call was made relative to the timeline of the recording in nanoseconds.
+    constexpr static size_t MaxReportedDivergences{10}; //!< Only the first divergences are reported individually, the rest are only counted.
+    size_t reportedDivergences{};
+
+    int ApplyHwParams(const uint64_t (&arguments)[2]) {
+        auto format{static_cast<snd_pcm_format_t>(arguments[0] & 0xFF)};
+        access = static_cast<snd_pcm_access_t>(arguments[0] >> 16 & 0xFFFF);
+        channels = static_cast<unsigned int>(arguments[0] >> 8 & 0xFF);
+        auto rate{static_cast<unsigned int>(arguments[0] >> 32)};
+        snd_pcm_uframes_t bufferSize{arguments[1] & 0xFFFFFFFF}, periodSize{arguments[1] >> 32};
+
+        snd_pcm_hw_params_t* params;
+        snd_pcm_hw_params_alloca(&params);
+        int err{snd_pcm_hw_params_any(pcm, params)};
+        if (err >= 0)
+            err = snd_pcm_hw_params_set_access(pcm, params, access);
+        if (err >= 0)
+            err = snd_pcm_hw_params_set_format(pcm, params, format);
+        if (err >= 0)
+            err = snd_pcm_hw_params_set_channels(pcm, params, channels);
+        if (err >= 0)
+            err = snd_pcm_hw_params_set_rate(pcm, params, rate, 0);
+        if (err >= 0)
+            err = snd_pcm_hw_params_set_period_size_near(pcm, params, &periodSize, nullptr);
+        if (err >= 0)
+            err = snd_pcm_hw_params_set_buffer_size_near(pcm, params, &bufferSize);
+        if (err >= 0)
+            err = snd_pcm_hw_params(pcm, params); // This prepares the PCM as well.
+        if (err < 0) {
+            std::fprintf(stderr, "Failed to apply hardware parameters (%s, %u channels @ %uHz): %s\n", snd_pcm_format_name(format), channels, rate, snd_strerror(err));
+            return err;
+        }
+
+        frameSize = static_cast<size_t>(snd_pcm_format_physical_width(format) / 8) * channels;
+        hwParams[0] = arguments[0];
+        hwParams[1] = arguments[1];
+        return 0;
+    }
+
+    int64_t Transfer(snd_pcm_uframes_t size) {
+        if (buffer.size() < size * frameSize)
+            buffer.resize(size * frameSize);
+
+        bool capture{stream == SND_PCM_STREAM_CAPTURE};
+        if (access == SND_PCM_ACCESS_RW_INTERLEAVED)
+            return capture ? snd_pcm_readi(pcm, buffer.data(), size) : snd_pcm_writei(pcm, buffer.data(), size);
+
+        std::vector<void*> planes(channels);
+        for (unsigned int c{}; c < channels; c++)
+            planes[c] = buffer.data() + c * size * (frameSize / channels);
+        return capture ? snd_pcm_readn(pcm, planes.data(), size) : snd_pcm_writen(pcm, planes.data(), size);
+    }
+
+    int SetSwParams(const uint64_t (&arguments)[2]) {
+        snd_pcm_sw_params_t* params;
+        snd_pcm_sw_params_alloca(&params);
+        int err{snd_pcm_sw_params_current(pcm, params)};
+        if (err < 0)
+            return err;
+
+        // Starts are replayed from the trace, so ALSA isn't allowed to start the PCM on its own. Transfers still start it from inside the plugin as recorded.
+        snd_pcm_uframes_t boundary;
+        snd_pcm_sw_params_get_boundary(params, &boundary);
+        snd_pcm_sw_params_set_start_threshold(pcm, params, boundary);
+        snd_pcm_sw_params_set_avail_min(pcm, params, arguments[0]);
+        snd_pcm_sw_params_set_period_event(pcm, params, static_cast<int>(arguments[1]));
+        return snd_pcm_sw_params(pcm, params);
+    }
+
+    int PollRevents() {
+        int count{snd_pcm_poll_descriptors_count(pcm)};
+        if (count <= 0)
+            return count;
+
+        // The descriptors are reported as ready as they were when the application polled them, the plugin decides what's actually ready.
+        std::vector<struct pollfd> descriptors(static_cast<size_t>(count));
+        count = snd_pcm_poll_descriptors(pcm, descriptors.data(), static_cast<unsigned int>(count));
+        for (auto& descriptor : descriptors)
+            descriptor.revents = descriptor.events;
+
+        unsigned short revents;
+        return snd_pcm_poll_descriptors_revents(pcm, descriptors.data(), static_cast<unsigned int>(count), &revents);
+    }
+
+    int64_t Dispatch(const trace::TraceRecord& record) {
+        switch (record.event) {
+            case trace::Event::Start:
+                return snd_pcm_start(pcm);
+            case trace::Event::Stop:
+                return snd_pcm_drop(pcm);
+            case trace::Event::Pointer:
+                return snd_pcm_avail_update(pcm);
+            case trace::Event::Transfer:
+                return Transfer(record.arguments[0]);
+            case trace::Event::Prepare:
+                if (hwParams[0] != record.arguments[0] || hwParams[1] != record.arguments[1])
+                    return ApplyHwParams(record.arguments);
+                return snd_pcm_prepare(pcm);
+            case trace::Event::HwFree:
+                hwParams[0] = hwParams[1] = 0;
+                return snd_pcm_hw_free(pcm);
+            case trace::Event::SwParams:
+                return SetSwParams(record.arguments);
+            case trace::Event::Drain:
+                return snd_pcm_drain(pcm);
+            case trace::Event::Pause:
+                return snd_pcm_pause(pcm, static_cast<int>(record.arguments[0]));
+            case trace::Event::Resume:
+                return snd_pcm_resume(pcm);
+            case trace::Event::PollRevents:
+                return PollRevents();
+            case trace::Event::Delay: {
+                snd_pcm_sframes_t delay;
+                return snd_pcm_delay(pcm, &delay);
+            }
+            default:
+                return -EINVAL;
+        }
+    }
+
+  public:
+    Replayer(snd_pcm_t* pcm, snd_pcm_stream_t stream) : pcm{pcm}, stream{stream} {}
+
+    /**
+     * @param speed The factor that the timeline of the recording is sped up by, 0 replays every call as soon as the previous one returned.
+     */
+    void Run(const std::vector<trace::TraceRecord>& records, double speed) {
+        int64_t origin{GetMonotonicNanoseconds()};
+        for (size_t index{}; index < records.size(); index++) {
+            const auto& record{records[index]};
+            if (record.event >= trace::Event::Count)
+                continue;
+
+            if (speed > 0) {
+                int64_t target{origin + static_cast<int64_t>(static_cast<double>(record.timestamp) / speed)};
+                struct timespec ts{static_cast<time_t>(target / 1000000000), static_cast<long>(target % 1000000000)};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+                lateness.push_back(GetMonotonicNanoseconds() - target);
+            }
+
+            int64_t start{GetMonotonicNanoseconds()};
+            int64_t result{Dispatch(record)};
+            auto& event{statistics[static_cast<size_t>(record.event)]};
+            event.durations.push_back(GetMonotonicNanoseconds() - start);
+            event.recordedDuration += record.duration;
+            event.recordedMaximum = std::max(event.recordedMaximum, record.duration);
+
+            if ((result < 0) != (record.result < 0)) {
+                event.divergences++;
+                if (reportedDivergences++ < MaxReportedDivergences)
+                    std::printf("Divergence at record %zu (%.3fms): %s returned %" PRId64 ", recorded %" PRId64 "\n", index, static_cast<double>(record.timestamp) / 1e6, trace::ToString(record.event), result, record.result);
+            }
+        }
+    }
+
+    void Report() {
+        std::printf("%-12s %8s %12s %12s %12s %14s %14s %8s\n", "callback", "calls", "mean (us)", "p99 (us)", "max (us)", "rec mean (us)", "rec max (us)", "diverged");
+        for (size_t index{}; index < statistics.size(); index++) {
+            auto& event{statistics[index]};
+            size_t count{event.durations.size()};
+            if (!count)
+                continue;
+
+            int64_t total{};
+            for (int64_t duration : event.durations)
+                total += duration;
+            int64_t p99{GetPercentile(event.durations, 0.99)}, maximum{*std::max_element(event.durations.begin(), event.durations.end())};
+            std::printf("%-12s %8zu %12.1f %12.1f %12.1f %14.1f %14u %8" PRIu64 "\n", trace::ToString(static_cast<trace::Event>(index)), count, static_cast<double>(total) / count / 1e3, static_cast<double>(p99) / 1e3, static_cast<double>(maximum) / 1e3, static_cast<double>(event.recordedDuration) / count, event.recordedMaximum, event.divergences);
+        }
+
+        if (!lateness.empty()) {
+            int64_t p99{GetPercentile(lateness, 0.99)}, maximum{*std::max_element(lateness.begin(), lateness.end())};
+            std::printf("Timeline lateness: p99 %.3fms, max %.3fms\n", static_cast<double>(p99) / 1e6, static_cast<double>(maximum) / 1e6);
+        }
+    }
+};
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <trace> [--speed=<factor>] [<option>=<value>...]\n", argv[0]);
+        std::fprintf(stderr, "Options are passed to the Oboe PCM as they would be in its ALSA configuration, a speed of 0 replays without any delays.\n");
+        return 1;
+    }
+
+    std::ifstream file{argv[1], std::ios::binary};
+    trace::TraceHeader header{};
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, trace::Magic, sizeof(header.magic)) != 0 || header.version != trace::Version) {
+        std::fprintf(stderr, "%s isn't a trace of a compatible version\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<trace::TraceRecord> records;
+    trace::TraceRecord record;
+    while (file.read(reinterpret_cast<char*>(&record), sizeof(record)))
+        records.push_back(record);
+
+    double speed{1.0};
+    std::string definition{"replay { type oboe\n"};
+    for (int index{2}; index < argc; index++) {
+        std::string argument{argv[index]};
+        if (argument.rfind("--speed=", 0) == 0) {
+            speed = std::stod(argument.substr(8));
+            continue;
+        }
+
+        size_t separator{argument.find('=')};
+        if (separator == std::string::npos) {
+            std::fprintf(stderr, "Invalid option: %s\n", argument.c_str());
+            return 1;
+        }
+        definition += argument.substr(0, separator) + " " + argument.substr(separator + 1) + "\n";
+    }
+    definition += "}\n";
+
+    snd_config_t *root, *conf;
+    snd_input_t* input;
+    int err{snd_config_top(&root)};
+    if (err >= 0)
+        err = snd_input_buffer_open(&input, definition.data(), static_cast<ssize_t>(definition.size()));
+    if (err >= 0) {
+        err = snd_config_load(root, input);
+        snd_input_close(input);
+    }
+    if (err >= 0)
+        err = snd_config_search(root, "replay", &conf);
+    if (err < 0) {
+        std::fprintf(stderr, "Invalid PCM definition: %s\n", snd_strerror(err));
+        return 1;
+    }
+
+    snd_pcm_t* pcm;
+    err = _snd_pcm_oboe_open(&pcm, "replay", root, conf, static_cast<snd_pcm_stream_t>(header.stream), static_cast<int>(header.mode));
+    if (err < 0) {
+        std::fprintf(stderr, "Failed to open the PCM: %s\n", snd_strerror(err));
+        return 1;
+    }
+
+    std::printf("Replaying %zu callbacks of a %s PCM over %.3fs\n", records.size(), header.stream == SND_PCM_STREAM_CAPTURE ? "capture" : "playback", records.empty() ? 0.0 : static_cast<double>(records.back().timestamp) / 1e9);
+    Replayer replayer{pcm, static_cast<snd_pcm_stream_t>(header.stream)};
+    replayer.Run(records, speed);
+    replayer.Report();
+
+    snd_pcm_close(pcm);
+    snd_config_delete(root);
+    return 0;
+}
@@ -0,0 +1,381 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright © 2024 Cassia Team (https://github.com/cassia-org)
+ */
+
+#include <alsa/asoundlib.h>
+#include <oboe/Oboe.h>
+#include <time.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Hammers the state machine of the plugin with random calls from multiple threads against the simulated Oboe backend, with faults injected into the device.
+ * @note The PCMs are linked into a group so that calls on one of them change the state of the others, which is where calls from different threads contend.
+ *       Every call is watched: calls that run for longer than the hang threshold are reported as they happen, and if any call exceeds the deadlock threshold the
+ *       calls in flight are reported and the process is aborted since it can't recover from a deadlock.
+ */
+
+extern "C" int _snd_pcm_oboe_open(snd_pcm_t** pcmp, const char* name, snd_config_t* root, snd_config_t* conf, snd_pcm_stream_t stream, int mode);
+
+static int64_t GetMonotonicNanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t GetPercentile(std::vector<int64_t>& samples, double percentile) {
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(static_cast<size_t>(static_cast<double>(samples.size()) * percentile), samples.size() - 1)];
+}
+
+enum class Operation {
+    Start,
+    Drop,
+    Prepare,
+    Pause,
+    Resume,
+    Drain,
+    Write,
+    Delay,
+    Reconfigure, //!< snd_pcm_hw_free followed by snd_pcm_hw_params with random parameters.
+    Count,
+};
+
+static const char* ToString(Operation operation) {
+    constexpr const char* Names[]{"start", "drop", "prepare", "pause", "resume", "drain", "write", "delay", "reconfigure"};
+    return Names[static_cast<size_t>(operation)];
+}
+
+/**
+ * @brief The operations that change the state of the PCM, their latencies are what the summary reports.
+ */
+static bool IsTransition(Operation operation) {
+    return operation != Operation::Write && operation != Operation::Delay;
+}
+
+struct Options {
+    unsigned int threads{4};
+    unsigned int pcms{2};
+    bool capture{}; //!< If a capture PCM is paired with the first playback PCM.
+    double duration{10}; //!< The duration of the test in seconds.
+    int64_t hangNanoseconds{1000000000};
+    int64_t deadlockNanoseconds{10000000000};
+    std::string pcmOptions; //!< Additional options for the definitions of all PCMs.
+};
+
+static int ConfigurePcm(snd_pcm_t* pcm, unsigned int rate, snd_pcm_uframes_t bufferSize) {
+    snd_pcm_hw_params_t* params;
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_uframes_t periodSize{bufferSize / 4};
+    int err{snd_pcm_hw_params_any(pcm, params)};
+    if (err >= 0)
+        err = snd_pcm_hw_params_set_access(pcm, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    if (err >= 0)
+        err = snd_pcm_hw_params_set_format(pcm, params, SND_PCM_FORMAT_S16_LE);
+    if (err >= 0)
+        err = snd_pcm_hw_params_set_channels(pcm, params, 2);
+    if (err >= 0)
+        err = snd_pcm_hw_params_set_rate(pcm, params, rate, 0);
+    if (err >= 0)
+        err = snd_pcm_hw_params_set_period_size_near(pcm, params, &periodSize, nullptr);
+    if (err >= 0)
+        err = snd_pcm_hw_params_set_buffer_size_near(pcm, params, &bufferSize);
+    if (err >= 0)
+        err = snd_pcm_hw_params(pcm, params);
+    return err;
+}
+
+class StressTest {
+  private:
+    Options options;
+    snd_config_t* root{};
+    std::vector<snd_pcm_t*> pcms;
+    std::atomic<bool> stopping{};
+
+    /**
+     * @brief The call that a worker is currently making, this is read by the watchdog.
+     */
+    struct Worker {
+        std::thread thread;
+        std::atomic<int64_t> callStart{}; //!< The time at which the current call was made, 0 if the worker isn't in a call.
+        std::atomic<Operation> operation{};
+        std::atomic<size_t> pcm{};
+        bool reported{}; //!< If the current call was already reported as hung, this is only accessed by the watchdog.
+
+        std::array<std::vector<int64_t>, static_cast<size_t>(Operation::Count)> latencies; //!< The durations of all calls, this is only accessed by the worker until it's joined.
+        std::array<uint64_t, static_cast<size_t>(Operation::Count)> errors{};
+    };
+    std::vector<Worker> workers;
+    uint64_t hungCalls{}; //!< The amount of calls that exceeded the hang threshold, this is only accessed by the watchdog.
+
+    int64_t Perform(Operation operation, snd_pcm_t* pcm, std::mt19937_64& engine, std::vector<int16_t>& buffer) {
+        switch (operation) {
+            case Operation::Start:
+                return snd_pcm_start(pcm);
+            case Operation::Drop:
+                return snd_pcm_drop(pcm);
+            case Operation::Prepare:
+                return snd_pcm_prepare(pcm);
+            case Operation::Pause:
+                return snd_pcm_pause(pcm, 1);
+            case Operation::Resume:
+                return snd_pcm_pause(pcm, 0);
+            case Operation::Drain:
+                return snd_pcm_drain(pcm);
+            case Operation::Write: {
+                // Only what fits is transferred so that a blocked transfer is always an issue with the plugin rather than with the test.
+                snd_pcm_sframes_t avail{snd_pcm_avail_update(pcm)};
+                if (avail <= 0)
+                    return avail;
+                auto frames{std::min<snd_pcm_uframes_t>(static_cast<snd_pcm_uframes_t>(avail), buffer.size() / 2)};
+                bool capture{snd_pcm_stream(pcm) == SND_PCM_STREAM_CAPTURE};
+                return capture ? snd_pcm_readi(pcm, buffer.data(), frames) : snd_pcm_writei(pcm, buffer.data(), frames);
+            }
+            case Operation::Delay: {
+                snd_pcm_sframes_t delay;
+                return snd_pcm_delay(pcm, &delay);
+            }
+            case Operation::Reconfigure: {
+                constexpr unsigned int Rates[]{44100, 48000};
+                constexpr snd_pcm_uframes_t BufferSizes[]{2048, 4096, 8192};
+                snd_pcm_hw_free(pcm);
+                return ConfigurePcm(pcm, Rates[engine() % std::size(Rates)], BufferSizes[engine() % std::size(BufferSizes)]);
+            }
+            default:
+                return -EINVAL;
+        }
+    }
+
+    void RunWorker(Worker& worker, uint64_t seed) {
+        std::mt19937_64 engine{seed};
+        std::vector<int16_t> buffer(2048 * 2);
+        // Transfers dominate like they do in applications, the transitions are spread across the rest.
+        constexpr std::array<unsigned int, static_cast<size_t>(Operation::Count)> Weights{3, 2, 2, 1, 1, 1, 8, 2, 1};
+        std::discrete_distribution<size_t> operations{Weights.begin(), Weights.end()};
+
+        while (!stopping.load()) {
+            auto operation{static_cast<Operation>(operations(engine))};
+            size_t index{engine() % pcms.size()};
+            worker.operation.store(operation);
+            worker.pcm.store(index);
+
+            int64_t start{GetMonotonicNanoseconds()};
+            worker.callStart.store(start);
+            int64_t result{Perform(operation, pcms[index], engine, buffer)};
+            worker.callStart.store(0);
+
+            worker.latencies[static_cast<size_t>(operation)].push_back(GetMonotonicNanoseconds() - start);
+            if (result < 0)
+                worker.errors[static_cast<size_t>(operation)]++;
+            if (result == -EPIPE || result == -ESTRPIPE)
+                snd_pcm_prepare(pcms[index]);
+        }
+    }
+
+    void ReportCallsInFlight(int64_t now) {
+        for (size_t index{}; index < workers.size(); index++) {
+            auto& worker{workers[index]};
+            int64_t start{worker.callStart.load()};
+            if (start)
+                std::printf("  thread %zu: %s on PCM %zu for %.1fms\n", index, ToString(worker.operation.load()), worker.pcm.load(), static_cast<double>(now - start) / 1e6);
+        }
+
+        auto statistics{oboe::sim::GetStatistics()};
+        if (statistics.activeWaits)
+            std::printf("  %u waits for a stream state change in progress, the oldest for %.1fms\n", statistics.activeWaits, static_cast<double>(statistics.oldestActiveWaitNanoseconds) / 1e6);
+    }
+
+    /**
+     * @return If the test deadlocked, the calls in flight were reported.
+     */
+    bool Watch() {
+        int64_t end{GetMonotonicNanoseconds() + static_cast<int64_t>(options.duration * 1e9)};
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::milliseconds{50});
+            int64_t now{GetMonotonicNanoseconds()};
+            if (now >= end)
+                stopping.store(true);
+
+            bool busy{};
+            for (size_t index{}; index < workers.size(); index++) {
+                auto& worker{workers[index]};
+                int64_t start{worker.callStart.load()};
+                if (!start) {
+                    worker.reported = false;
+                    continue;
+                }
+                busy = true;
+
+                int64_t elapsed{now - start};
+                if (elapsed >= options.deadlockNanoseconds) {
+                    std::printf("DEADLOCK: thread %zu made no progress in %s on PCM %zu for %.1fms, calls in flight:\n", index, ToString(worker.operation.load()), worker.pcm.load(), static_cast<double>(elapsed) / 1e6);
+                    ReportCallsInFlight(now);
+                    return true;
+                }
+                if (elapsed >= options.hangNanoseconds && !worker.reported) {
+                    worker.reported = true;
+                    hungCalls++;
+                    std::printf("Hung call: thread %zu in %s on PCM %zu for %.1fms\n", index, ToString(worker.operation.load()), worker.pcm.load(), static_cast<double>(elapsed) / 1e6);
+                }
+            }
+
+            if (stopping.load() && !busy)
+                return false;
+        }
+    }
+
+    void Report() {
+        std::printf("%-12s %10s %10s %12s %12s %12s\n", "call", "calls", "errors", "p50 (ms)", "p99 (ms)", "max (ms)");
+        std::vector<int64_t> transitions;
+        for (size_t operation{}; operation < static_cast<size_t>(Operation::Count); operation++) {
+            std::vector<int64_t> latencies;
+            uint64_t errors{};
+            for (auto& worker : workers) {
+                auto& samples{worker.latencies[operation]};
+                latencies.insert(latencies.end(), samples.begin(), samples.end());
+                errors += worker.errors[operation];
+            }
+            if (latencies.empty())
+                continue;
+            if (IsTransition(static_cast<Operation>(operation)))
+                transitions.insert(transitions.end(), latencies.begin(), latencies.end());
+
+            size_t count{latencies.size()};
+            int64_t p50{GetPercentile(latencies, 0.5)}, p99{GetPercentile(latencies, 0.99)}, maximum{*std::max_element(latencies.begin(), latencies.end())};
+            std::printf("%-12s %10zu %10" PRIu64 " %12.3f %12.3f %12.3f\n", ToString(static_cast<Operation>(operation)), count, errors, static_cast<double>(p50) / 1e6, static_cast<double>(p99) / 1e6, static_cast<double>(maximum) / 1e6);
+        }
+
+        int64_t p99{GetPercentile(transitions, 0.99)}, maximum{transitions.empty() ? 0 : *std::max_element(transitions.begin(), transitions.end())};
+        std::printf("Transition latency: p99 %.3fms, max %.3fms over %zu transitions\n", static_cast<double>(p99) / 1e6, static_cast<double>(maximum) / 1e6, transitions.size());
+
+        auto statistics{oboe::sim::GetStatistics()};
+        std::printf("Hung calls: %" PRIu64 "\n", hungCalls);
+        std::printf("Stream state waits: %" PRIu64 ", timed out %" PRIu64 ", longest %.3fms, still waiting %u\n", statistics.waits, statistics.timedOutWaits, static_cast<double>(statistics.longestWaitNanoseconds) / 1e6, statistics.activeWaits);
+        std::printf("Injected faults: %" PRIu64 " failed requests, %" PRIu64 " stalls, %" PRIu64 " lost wakeups\n", statistics.injectedFailures, statistics.injectedStalls, statistics.lostWakeups);
+    }
+
+    int OpenPcm(const std::string& name, snd_pcm_stream_t stream, const std::string& groups) {
+        std::string definition{name + " { type oboe\n" + groups + options.pcmOptions + "}\n"};
+        snd_input_t* input;
+        int err{snd_input_buffer_open(&input, definition.data(), static_cast<ssize_t>(definition.size()))};
+        if (err >= 0) {
+            err = snd_config_load(root, input);
+            snd_input_close(input);
+        }
+
+        snd_config_t* conf;
+        if (err >= 0)
+            err = snd_config_search(root, name.c_str(), &conf);
+
+        snd_pcm_t* pcm;
+        if (err >= 0)
+            err = _snd_pcm_oboe_open(&pcm, name.c_str(), root, conf, stream, 0);
+        if (err >= 0) {
+            pcms.push_back(pcm);
+            err = ConfigurePcm(pcm, 48000, 4096);
+        }
+        if (err < 0)
+            std::fprintf(stderr, "Failed to set up %s: %s\n", name.c_str(), snd_strerror(err));
+        return err;
+    }
+
+  public:
+    StressTest(const Options& options) : options{options}, workers(options.threads) {}
+
+    /**
+     * @return The exit code of the test, 0 if there were no hung calls, 1 if there were and 2 if the test deadlocked.
+     */
+    int Run() {
+        int err{snd_config_top(&root)};
+        for (unsigned int index{}; err >= 0 && index < options.pcms; index++)
+            err = OpenPcm("stress" + std::to_string(index), SND_PCM_STREAM_PLAYBACK, std::string{"link_group stress\n"} + (options.capture && !index ? "duplex_group stress\n" : ""));
+        if (err >= 0 && options.capture)
+            err = OpenPcm("stress_capture", SND_PCM_STREAM_CAPTURE, "duplex_group stress\n");
+        if (err < 0)
+            return 1;
+
+        std::random_device seeds;
+        for (auto& worker : workers)
+            worker.thread = std::thread{[this, &worker, seed = seeds()] { RunWorker(worker, seed); }};
+
+        if (Watch()) {
+            // The deadlocked threads can't be joined and the PCMs can't be closed, so the process is terminated right away.
+            std::fflush(stdout);
+            std::_Exit(2);
+        }
+
+        for (auto& worker : workers)
+            worker.thread.join();
+        Report();
+
+        for (auto* pcm : pcms)
+            snd_pcm_close(pcm);
+        snd_config_delete(root);
+        return hungCalls ? 1 : 0;
+    }
+};
+
+int main(int argc, char** argv) {
+    Options options;
+    oboe::sim::DeviceConfig device{oboe::sim::GetDeviceConfig()};
+    for (int index{1}; index < argc; index++) {
+        std::string argument{argv[index]};
+        size_t separator{argument.find('=')};
+        if (argument == "--capture") {
+            options.capture = true;
+            continue;
+        }
+        if (argument.rfind("--", 0) != 0 && separator != std::string::npos) {
+            options.pcmOptions += argument.substr(0, separator) + " " + argument.substr(separator + 1) + "\n";
+            continue;
+        }
+        if (separator == std::string::npos) {
+            std::fprintf(stderr, "Usage: %s [--threads=<count>] [--pcms=<count>] [--capture] [--duration=<s>] [--hang-ms=<ms>] [--deadlock-ms=<ms>]\n", argv[0]);
+            std::fprintf(stderr, "       [--transition-delay-ms=<ms>] [--failure-rate=<p>] [--stall-rate=<p>] [--stall-ms=<ms>] [--lost-wakeup-rate=<p>] [<option>=<value>...]\n");
+            return 1;
+        }
+
+        std::string key{argument.substr(0, separator)};
+        double value{std::strtod(argument.c_str() + separator + 1, nullptr)};
+        if (key == "--threads")
+            options.threads = std::max(static_cast<unsigned int>(value), 1U);
+        else if (key == "--pcms")
+            options.pcms = std::max(static_cast<unsigned int>(value), 1U);
+        else if (key == "--duration")
+            options.duration = value;
+        else if (key == "--hang-ms")
+            options.hangNanoseconds = static_cast<int64_t>(value * 1e6);
+        else if (key == "--deadlock-ms")
+            options.deadlockNanoseconds = static_cast<int64_t>(value * 1e6);
+        else if (key == "--transition-delay-ms")
+            device.transitionDelayNanoseconds = static_cast<int64_t>(value * 1e6);
+        else if (key == "--failure-rate")
+            device.failureRate = value;
+        else if (key == "--stall-rate")
+            device.stallRate = value;
+        else if (key == "--stall-ms")
+            device.stallNanoseconds = static_cast<int64_t>(value * 1e6);
+        else if (key == "--lost-wakeup-rate")
+            device.lostWakeupRate = value;
+        else {
+            std::fprintf(stderr, "Unknown argument: %s\n", argument.c_str());
+            return 1;
+        }
+    }
+    oboe::sim::SetDeviceConfig(device);
+
+    std::printf("Stressing %u playback PCM(s)%s from %u threads for %.1fs\n", options.pcms, options.capture ? " and a capture PCM" : "", options.threads, options.duration);
+    return StressTest{options}.Run();
+}
@@ -0,0 +1,435 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright © 2024 Cassia Team (https://github.com/cassia-org)
+ */
+
+#include <oboe/Oboe.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <set>
+
+namespace oboe {
+    namespace {
+        std::mutex deviceConfigMutex;
+        sim::DeviceConfig deviceConfig;
+
+        std::mutex statisticsMutex;
+        sim::Statistics statistics{}; //!< The statistics other than those of active waits, this is protected by statisticsMutex.
+        std::multiset<int64_t> activeWaitStarts; //!< The times at which the active waits started, this is protected by statisticsMutex.
+
+        int64_t GetMonotonicNanoseconds() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return static_cast<int64_t>(ts.tv_sec) * kNanosPerSecond + ts.tv_nsec;
+        }
+
+        /**
+         * @return If an injected fault with the supplied probability occurs.
+         */
+        bool RollFault(double probability) {
+            if (probability <= 0)
+                return false;
+            thread_local std::mt19937_64 engine{std::random_device{}()};
+            return std::uniform_real_distribution<double>{}(engine) < probability;
+        }
+
+        /**
+         * @return A random delay up to the supplied maximum.
+         */
+        int64_t RollDelay(int64_t maximum) {
+            if (maximum <= 0)
+                return 0;
+            thread_local std::mt19937_64 engine{std::random_device{}()};
+            return std::uniform_int_distribution<int64_t>{0, maximum}(engine);
+        }
+
+        void CountFault(uint64_t sim::Statistics::*counter) {
+            std::scoped_lock lock{statisticsMutex};
+            statistics.*counter += 1;
+        }
+
+        /**
+         * @return The state that a transitional state settles into.
+         */
+        StreamState GetSettledState(StreamState state) {
+            switch (state) {
+                case StreamState::Starting:
+                    return StreamState::Started;
+                case StreamState::Pausing:
+                    return StreamState::Paused;
+                case StreamState::Flushing:
+                    return StreamState::Flushed;
+                case StreamState::Stopping:
+                    return StreamState::Stopped;
+                default:
+                    return state;
+            }
+        }
+    }
+
+    void sim::SetDeviceConfig(const DeviceConfig& config) {
+        std::scoped_lock lock{deviceConfigMutex};
+        deviceConfig = config;
+    }
+
+    sim::DeviceConfig sim::GetDeviceConfig() {
+        std::scoped_lock lock{deviceConfigMutex};
+        return deviceConfig;
+    }
+
+    sim::Statistics sim::GetStatistics() {
+        std::scoped_lock lock{statisticsMutex};
+        Statistics result{statistics};
+        result.activeWaits = static_cast<uint32_t>(activeWaitStarts.size());
+        result.oldestActiveWaitNanoseconds = activeWaitStarts.empty() ? 0 : GetMonotonicNanoseconds() - *activeWaitStarts.begin();
+        return result;
+    }
+
+    Result AudioStreamBuilder::openStream(std::shared_ptr<AudioStream>& stream) {
+        if (format == AudioFormat::Invalid)
+            return Result::ErrorInvalidFormat;
+        if (channelCount <= 0 || sampleRate < 0 || bufferCapacityInFrames < 0)
+            return Result::ErrorIllegalArgument;
+
+        stream.reset(new AudioStream{*this});
+        return Result::OK;
+    }
+
+    AudioStream::AudioStream(const AudioStreamBuilder& builder) : direction{builder.direction}, format{builder.format == AudioFormat::Unspecified ? AudioFormat::Float : builder.format}, channelCount{builder.channelCount}, audioApi{builder.audioApi == AudioApi::Unspecified ? AudioApi::AAudio : builder.audioApi}, inputPreset{builder.inputPreset}, dataCallback{builder.dataCallback} {
+        sim::DeviceConfig config{sim::GetDeviceConfig()};
+        sampleRate = builder.sampleRate ? builder.sampleRate : config.sampleRate;
+
+        // The burst is kept at the same duration regardless of the rate, the capacity is always a whole amount of bursts.
+        framesPerBurst = std::max(static_cast<int32_t>(static_cast<int64_t>(config.framesPerBurst) * sampleRate / config.sampleRate), 16);
+        int32_t capacity{builder.bufferCapacityInFrames ? builder.bufferCapacityInFrames : framesPerBurst * config.capacityBursts};
+        bufferCapacityInFrames = (capacity + framesPerBurst - 1) / framesPerBurst * framesPerBurst;
+        bufferSizeInFrames = std::min(framesPerBurst * 2, bufferCapacityInFrames);
+
+        callbackBuffer.resize(static_cast<size_t>(framesPerBurst) * getBytesPerFrame());
+        device = std::thread{[this] { DeviceLoop(); }};
+    }
+
+    AudioStream::~AudioStream() {
+        close();
+    }
+
+    int32_t AudioStream::getBytesPerSample() const {
+        switch (format) {
+            case AudioFormat::I16:
+                return 2;
+            case AudioFormat::I24:
+                return 3;
+            default:
+                return 4;
+        }
+    }
+
+    void AudioStream::DeviceLoop() {
+        int64_t burstNanoseconds{static_cast<int64_t>(framesPerBurst) * kNanosPerSecond / sampleRate};
+        auto next{std::chrono::steady_clock::now()};
+
+        std::unique_lock lock{mutex};
+        while (!closing) {
+            if (condition.wait_until(lock, next, [this] { return closing; }))
+                break;
+
+            sim::DeviceConfig config{sim::GetDeviceConfig()};
+            if (RollFault(config.stallRate)) {
+                // A stalled device holds back everything, like a HAL blocked in the kernel. Closing still interrupts it.
+                CountFault(&sim::Statistics::injectedStalls);
+                if (condition.wait_for(lock, std::chrono::nanoseconds{config.stallNanoseconds}, [this] { return closing; }))
+                    break;
+            }
+
+            // Transitions are requested asynchronously and settle on the next burst after their delay, similar to how AAudio applies them on its own thread.
+            StreamState settled{GetSettledState(state)};
+            if (settled != state && GetMonotonicNanoseconds() >= settleTime) {
+                if (settled == StreamState::Flushed || settled == StreamState::Stopped) {
+                    framesRead.store(framesWritten.load()); // Anything that wasn't consumed by the device or the application is discarded.
+                    deviceTimestamp.store(0);
+                }
+                state = settled;
+                NotifyStateChange();
+            }
+
+            if (state == StreamState::Started) {
+                lock.unlock();
+                RunBurst();
+                lock.lock();
+            }
+
+            // The device doesn't try to catch up on bursts if the thread fell behind, it just continues from the current time like an underrunning device.
+            next = std::max(next + std::chrono::nanoseconds{burstNanoseconds}, std::chrono::steady_clock::now());
+        }
+    }
+
+    void AudioStream::RunBurst() {
+        int64_t now{GetMonotonicNanoseconds()};
+        deviceTimestamp.store(now);
+
+        if (direction == Direction::Output) {
+            // The device consumes a burst, any frames that the application didn't supply in time are silence and count as written.
+            int64_t read{framesRead.load() + framesPerBurst};
+            framesRead.store(read);
+            if (framesWritten.load() < read)
+                framesWritten.store(read);
+
+            // The data callback is invoked until the buffer is filled up to its size again, like AAudio does.
+            while (dataCallback && framesWritten.load() - framesRead.load() < bufferSizeInFrames.load()) {
+                if (dataCallback->onAudioReady(this, callbackBuffer.data(), framesPerBurst) == DataCallbackResult::Stop) {
+                    StopFromCallback();
+                    return;
+                }
+                framesWritten.fetch_add(framesPerBurst);
+            }
+            return;
+        }
+
+        // The simulated input is silence, input that the application doesn't read in time overflows the buffer and the oldest frames are lost.
+        int64_t written{framesWritten.load() + framesPerBurst};
+        framesWritten.store(written);
+        if (dataCallback) {
+            std::fill(callbackBuffer.begin(), callbackBuffer.end(), 0);
+            if (dataCallback->onAudioReady(this, callbackBuffer.data(), framesPerBurst) == DataCallbackResult::Stop)
+                StopFromCallback();
+            framesRead.fetch_add(framesPerBurst);
+        } else {
+            std::scoped_lock lock{mutex};
+            if (written - framesRead.load() > bufferCapacityInFrames)
+                framesRead.store(written - bufferCapacityInFrames);
+            condition.notify_all();
+        }
+    }
+
+    Result AudioStream::RequestTransition(StreamState transitional, std::initializer_list<StreamState> validStates) {
+        if (closing || state == StreamState::Closed)
+            return Result::ErrorClosed;
+        if (state == transitional || state == GetSettledState(transitional))
+            return Result::OK;
+        if (std::find(validStates.begin(), validStates.end(), state) == validStates.end())
+            return Result::ErrorInvalidState;
+
+        sim::DeviceConfig config{sim::GetDeviceConfig()};
+        if (RollFault(config.failureRate)) {
+            CountFault(&sim::Statistics::injectedFailures);
+            return Result::ErrorInternal;
+        }
+
+        state = transitional;
+        settleTime = GetMonotonicNanoseconds() + RollDelay(config.transitionDelayNanoseconds);
+        NotifyStateChange();
+        return Result::OK;
+    }
+
+    void AudioStream::NotifyStateChange() {
+        if (RollFault(sim::GetDeviceConfig().lostWakeupRate)) {
+            CountFault(&sim::Statistics::lostWakeups);
+            return;
+        }
+        condition.notify_all();
+    }
+
+    void AudioStream::StopFromCallback() {
+        std::scoped_lock lock{mutex};
+        if (closing || state == StreamState::Stopping || state == StreamState::Stopped)
+            return;
+        state = StreamState::Stopping;
+        settleTime = 0;
+        NotifyStateChange();
+    }
+
+    Result AudioStream::requestStart() {
+        std::scoped_lock lock{mutex};
+        return RequestTransition(StreamState::Starting, {StreamState::Open, StreamState::Paused, StreamState::Flushed, StreamState::Stopped});
+    }
+
+    Result AudioStream::requestPause() {
+        std::scoped_lock lock{mutex};
+        if (direction == Direction::Input)
+            return Result::ErrorUnimplemented; // AAudio doesn't support pausing input streams.
+        return RequestTransition(StreamState::Pausing, {StreamState::Starting, StreamState::Started});
+    }
+
+    Result AudioStream::requestFlush() {
+        std::scoped_lock lock{mutex};
+        return RequestTransition(StreamState::Flushing, {StreamState::Open, StreamState::Paused, StreamState::Stopped});
+    }
+
+    Result AudioStream::requestStop() {
+        std::scoped_lock lock{mutex};
+        return RequestTransition(StreamState::Stopping, {StreamState::Open, StreamState::Starting, StreamState::Started, StreamState::Pausing, StreamState::Paused, StreamState::Flushed});
+    }
+
+    Result AudioStream::close() {
+        {
+            std::scoped_lock lock{mutex};
+            if (closing)
+                return Result::OK;
+            closing = true;
+            state = StreamState::Closing;
+        }
+        condition.notify_all();
+        if (device.joinable())
+            device.join();
+
+        std::scoped_lock lock{mutex};
+        state = StreamState::Closed;
+        condition.notify_all();
+        return Result::OK;
+    }
+
+    StreamState AudioStream::getState() {
+        std::scoped_lock lock{mutex};
+        return state;
+    }
+
+    Result AudioStream::waitForStateChange(StreamState inputState, StreamState* nextState, int64_t timeoutNanoseconds) {
+        int64_t start{GetMonotonicNanoseconds()};
+        std::multiset<int64_t>::iterator activeWait;
+        {
+            std::scoped_lock lock{statisticsMutex};
+            statistics.waits++;
+            activeWait = activeWaitStarts.insert(start);
+        }
+
+        std::unique_lock lock{mutex};
+        bool changed{condition.wait_for(lock, std::chrono::nanoseconds{timeoutNanoseconds}, [&] { return state != inputState; })};
+        if (nextState)
+            *nextState = state;
+        lock.unlock();
+
+        {
+            std::scoped_lock statisticsLock{statisticsMutex};
+            activeWaitStarts.erase(activeWait);
+            statistics.longestWaitNanoseconds = std::max(statistics.longestWaitNanoseconds, GetMonotonicNanoseconds() - start);
+            if (!changed)
+                statistics.timedOutWaits++;
+        }
+        return changed ? Result::OK : Result::ErrorTimeout;
+    }
+
+    ResultWithValue<int32_t> AudioStream::setBufferSizeInFrames(int32_t requestedFrames) {
+        int32_t frames{std::clamp(requestedFrames, framesPerBurst, bufferCapacityInFrames)};
+        bufferSizeInFrames.store(frames);
+        return frames;
+    }
+
+    ResultWithValue<int32_t> AudioStream::read(void* buffer, int32_t numFrames, int64_t timeoutNanoseconds) {
+        if (direction != Direction::Input || dataCallback)
+            return Result::ErrorInvalidState;
+
+        std::unique_lock lock{mutex};
+        condition.wait_for(lock, std::chrono::nanoseconds{timeoutNanoseconds}, [&] { return closing || framesWritten.load() - framesRead.load() >= numFrames; });
+        auto frames{static_cast<int32_t>(std::min<int64_t>(framesWritten.load() - framesRead.load(), numFrames))};
+        std::memset(buffer, 0, static_cast<size_t>(frames) * getBytesPerFrame());
+        framesRead.fetch_add(frames);
+        return frames;
+    }
+
+    ResultWithValue<int32_t> AudioStream::getAvailableFrames() {
+        int64_t queued{framesWritten.load() - framesRead.load()};
+        return static_cast<int32_t>(direction == Direction::Input ? queued : bufferSizeInFrames.load() - queued);
+    }
+
+    ResultWithValue<FrameTimestamp> AudioStream::getTimestamp(clockid_t clockId) {
+        int64_t timestamp{deviceTimestamp.load()};
+        if (clockId != CLOCK_MONOTONIC || !timestamp || getState() != StreamState::Started)
+            return Result::ErrorInvalidState;
+
+        // The frames at the position are presented or captured at the time of the last burst of the device.
+        return FrameTimestamp{direction == Direction::Output ? framesRead.load() : framesWritten.load(), timestamp};
+    }
+
+    ResultWithValue<double> AudioStream::calculateLatencyMillis() {
+        if (getState() != StreamState::Started)
+            return Result::ErrorInvalidState;
+
+        int64_t frames{direction == Direction::Output ? framesWritten.load() - framesRead.load() : framesPerBurst};
+        return static_cast<double>(frames) * 1000.0 / sampleRate;
+    }
+
+    template <>
+    const char* convertToText<Result>(Result value) {
+        switch (value) {
+            case Result::OK:
+                return "OK";
+            case Result::ErrorDisconnected:
+                return "ErrorDisconnected";
+            case Result::ErrorIllegalArgument:
+                return "ErrorIllegalArgument";
+            case Result::ErrorInternal:
+                return "ErrorInternal";
+            case Result::ErrorInvalidState:
+                return "ErrorInvalidState";
+            case Result::ErrorUnimplemented:
+                return "ErrorUnimplemented";
+            case Result::ErrorTimeout:
+                return "ErrorTimeout";
+            case Result::ErrorInvalidFormat:
+                return "ErrorInvalidFormat";
+            case Result::ErrorClosed:
+                return "ErrorClosed";
+            default:
+                return "Unrecognized result";
+        }
+    }
+
+    template <>
+    const char* convertToText<StreamState>(StreamState value) {
+        constexpr const char* Names[]{"Uninitialized", "Unknown", "Open", "Starting", "Started", "Pausing", "Paused", "Flushing", "Flushed", "Stopping", "Stopped", "Closing", "Closed", "Disconnected"};
+        auto index{static_cast<size_t>(value)};
+        return index < std::size(Names) ? Names[index] : "Unrecognized stream state";
+    }
+
+    template <>
+    const char* convertToText<AudioFormat>(AudioFormat value) {
+        switch (value) {
+            case AudioFormat::I16:
+                return "I16";
+            case AudioFormat::Float:
+                return "Float";
+            case AudioFormat::I24:
+                return "I24";
+            case AudioFormat::I32:
+                return "I32";
+            case AudioFormat::Unspecified:
+                return "Unspecified";
+            default:
+                return "Invalid";
+        }
+    }
+
+    template <>
+    const char* convertToText<AudioApi>(AudioApi value) {
+        switch (value) {
+            case AudioApi::OpenSLES:
+                return "OpenSLES (simulated)";
+            case AudioApi::AAudio:
+                return "AAudio (simulated)";
+            default:
+                return "Unspecified";
+        }
+    }
+
+    template <>
+    const char* convertToText<InputPreset>(InputPreset value) {
+        switch (value) {
+            case InputPreset::Generic:
+                return "Generic";
+            case InputPreset::Camcorder:
+                return "Camcorder";
+            case InputPreset::VoiceRecognition:
+                return "VoiceRecognition";
+            case InputPreset::VoiceCommunication:
+                return "VoiceCommunication";
+            case InputPreset::Unprocessed:
+                return "Unprocessed";
+            case InputPreset::VoicePerformance:
+                return "VoicePerformance";
+            default:
+                return "Unrecognized input preset";
+        }
+    }
+}
@@ -0,0 +1,371 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright © 2024 Cassia Team (https://github.com/cassia-org)
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief A simulation of the subset of the Oboe API that the plugin uses, this allows building and driving the plugin on a regular Linux machine.
+ * @note Streams are driven by a thread per stream that models a device consuming or producing a burst at a time on CLOCK_MONOTONIC.
+ *       The semantics of state transitions follow AAudio, all of them are asynchronous and settle on the next burst of the device.
+ */
+namespace oboe {
+    constexpr int64_t kNanosPerMicrosecond{1000};
+    constexpr int64_t kNanosPerMillisecond{1000000};
+    constexpr int64_t kNanosPerSecond{1000000000};
+
+    enum class Result : int32_t {
+        OK = 0,
+        ErrorBase = -900,
+        ErrorDisconnected,
+        ErrorIllegalArgument,
+        ErrorInternal = -896,
+        ErrorInvalidState,
+        ErrorInvalidHandle = -892,
+        ErrorUnimplemented = -890,
+        ErrorUnavailable,
+        ErrorNoFreeHandles,
+        ErrorNoMemory,
+        ErrorNull,
+        ErrorTimeout,
+        ErrorWouldBlock,
+        ErrorInvalidFormat,
+        ErrorOutOfRange,
+        ErrorNoService,
+        ErrorInvalidRate,
+        ErrorClosed = -869,
+    };
+
+    enum class StreamState : int32_t {
+        Uninitialized = 0,
+        Unknown,
+        Open,
+        Starting,
+        Started,
+        Pausing,
+        Paused,
+        Flushing,
+        Flushed,
+        Stopping,
+        Stopped,
+        Closing,
+        Closed,
+        Disconnected,
+    };
+
+    enum class Direction : int32_t { Output = 0, Input = 1 };
+    enum class AudioFormat : int32_t { Invalid = -1, Unspecified = 0, I16 = 1, Float = 2, I24 = 3, I32 = 4 };
+    enum class DataCallbackResult : int32_t { Continue = 0, Stop };
+    enum class PerformanceMode : int32_t { None = 10, PowerSaving, LowLatency };
+    enum class SharingMode : int32_t { Exclusive = 0, Shared };
+    enum class Usage : int32_t { Media = 1, VoiceCommunication = 2, Alarm = 4, Notification = 5, Game = 14, Assistant = 16 };
+    enum class InputPreset : int32_t { Generic = 1, Camcorder = 5, VoiceRecognition = 6, VoiceCommunication = 7, Unprocessed = 9, VoicePerformance = 10 };
+    enum class AudioApi : int32_t { Unspecified = 0, OpenSLES, AAudio };
+    enum class SampleRateConversionQuality : int32_t { None, Fastest, Low, Medium, High, Best };
+
+    struct FrameTimestamp {
+        int64_t position;
+        int64_t timestamp;
+    };
+
+    template <typename FromType>
+    const char* convertToText(FromType value);
+
+    template <typename T>
+    class ResultWithValue {
+      private:
+        T mValue{};
+        Result mError;
+
+      public:
+        ResultWithValue(Result error) : mError{error} {}
+
+        ResultWithValue(T value) : mValue{value}, mError{Result::OK} {}
+
+        Result error() const {
+            return mError;
+        }
+
+        T value() const {
+            return mValue;
+        }
+
+        explicit operator bool() const {
+            return mError == Result::OK;
+        }
+
+        bool operator!() const {
+            return mError != Result::OK;
+        }
+
+        operator Result() const {
+            return mError;
+        }
+    };
+
+    class AudioStream;
+
+    class AudioStreamDataCallback {
+      public:
+        virtual ~AudioStreamDataCallback() = default;
+
+        virtual DataCallbackResult onAudioReady(AudioStream* audioStream, void* audioData, int32_t numFrames) = 0;
+    };
+
+    class AudioStreamBuilder {
+      private:
+        friend class AudioStream;
+
+        Direction direction{Direction::Output};
+        AudioFormat format{AudioFormat::Unspecified};
+        int32_t channelCount{2};
+        int32_t sampleRate{};
+        int32_t bufferCapacityInFrames{};
+        AudioApi audioApi{AudioApi::Unspecified};
+        InputPreset inputPreset{InputPreset::VoiceRecognition};
+        AudioStreamDataCallback* dataCallback{};
+
+      public:
+        AudioStreamBuilder* setDirection(Direction value) {
+            direction = value;
+            return this;
+        }
+
+        AudioStreamBuilder* setFormat(AudioFormat value) {
+            format = value;
+            return this;
+        }
+
+        AudioStreamBuilder* setChannelCount(int value) {
+            channelCount = value;
+            return this;
+        }
+
+        AudioStreamBuilder* setSampleRate(int32_t value) {
+            sampleRate = value;
+            return this;
+        }
+
+        AudioStreamBuilder* setBufferCapacityInFrames(int32_t value) {
+            bufferCapacityInFrames = value;
+            return this;
+        }
+
+        AudioStreamBuilder* setAudioApi(AudioApi value) {
+            audioApi = value;
+            return this;
+        }
+
+        AudioStreamBuilder* setInputPreset(InputPreset value) {
+            inputPreset = value;
+            return this;
+        }
+
+        AudioStreamBuilder* setDataCallback(AudioStreamDataCallback* value) {
+            dataCallback = value;
+            return this;
+        }
+
+        // The device is simulated without any processing, so these only exist for compatibility.
+        AudioStreamBuilder* setUsage(Usage) {
+            return this;
+        }
+
+        AudioStreamBuilder* setPerformanceMode(PerformanceMode) {
+            return this;
+        }
+
+        AudioStreamBuilder* setSharingMode(SharingMode) {
+            return this;
+        }
+
+        AudioStreamBuilder* setFormatConversionAllowed(bool) {
+            return this;
+        }
+
+        AudioStreamBuilder* setChannelConversionAllowed(bool) {
+            return this;
+        }
+
+        AudioStreamBuilder* setSampleRateConversionQuality(SampleRateConversionQuality) {
+            return this;
+        }
+
+        Result openStream(std::shared_ptr<AudioStream>& stream);
+    };
+
+    /**
+     * @brief A simulated stream, its device thread runs from opening the stream until it's closed.
+     */
+    class AudioStream {
+      private:
+        friend class AudioStreamBuilder;
+
+        Direction direction;
+        AudioFormat format;
+        int32_t channelCount;
+        int32_t sampleRate;
+        int32_t framesPerBurst;
+        int32_t bufferCapacityInFrames;
+        std::atomic<int32_t> bufferSizeInFrames;
+        AudioApi audioApi;
+        InputPreset inputPreset;
+        AudioStreamDataCallback* dataCallback;
+
+        std::mutex mutex; //!< Protects the state, this is never held while calling the data callback.
+        std::condition_variable condition; //!< Signalled on every state change and whenever input is produced.
+        StreamState state{StreamState::Open};
+        bool closing{};
+        int64_t settleTime{}; //!< The earliest time at which the current transitional state settles.
+        std::thread device;
+
+        std::atomic<int64_t> framesWritten{}; //!< The frames written into the stream by the application or by the device for input.
+        std::atomic<int64_t> framesRead{}; //!< The frames read from the stream by the device or by the application for input.
+        std::atomic<int64_t> deviceTimestamp{}; //!< The time of the last burst of the device, 0 if it hasn't run since being started.
+        std::vector<uint8_t> callbackBuffer; //!< The buffer handed to the data callback, this is only accessed by the device thread.
+
+        AudioStream(const AudioStreamBuilder& builder);
+
+        /**
+         * @brief Moves the stream into a transitional state, it settles on the next burst of the device. This must be called with the mutex held.
+         */
+        Result RequestTransition(StreamState transitional, std::initializer_list<StreamState> validStates);
+
+        /**
+         * @brief Wakes up the threads waiting on a state change unless the wakeup is lost to an injected fault. This must be called with the mutex held.
+         */
+        void NotifyStateChange();
+
+        /**
+         * @brief Stops the stream after the data callback returned DataCallbackResult::Stop, this is internal to the device so faults aren't injected into it.
+         */
+        void StopFromCallback();
+
+        void DeviceLoop();
+
+        /**
+         * @brief Runs a single burst of the device, this is called by the device thread without the mutex held.
+         */
+        void RunBurst();
+
+      public:
+        ~AudioStream();
+
+        Result requestStart();
+        Result requestPause();
+        Result requestFlush();
+        Result requestStop();
+        Result close();
+
+        StreamState getState();
+        Result waitForStateChange(StreamState inputState, StreamState* nextState, int64_t timeoutNanoseconds);
+
+        ResultWithValue<int32_t> setBufferSizeInFrames(int32_t requestedFrames);
+        ResultWithValue<int32_t> read(void* buffer, int32_t numFrames, int64_t timeoutNanoseconds);
+        ResultWithValue<int32_t> getAvailableFrames();
+        ResultWithValue<FrameTimestamp> getTimestamp(clockid_t clockId);
+        ResultWithValue<double> calculateLatencyMillis();
+
+        int64_t getFramesWritten() {
+            return framesWritten.load();
+        }
+
+        int64_t getFramesRead() {
+            return framesRead.load();
+        }
+
+        Direction getDirection() const {
+            return direction;
+        }
+
+        AudioFormat getFormat() const {
+            return format;
+        }
+
+        int32_t getChannelCount() const {
+            return channelCount;
+        }
+
+        int32_t getSampleRate() const {
+            return sampleRate;
+        }
+
+        int32_t getFramesPerBurst() const {
+            return framesPerBurst;
+        }
+
+        int32_t getBufferSizeInFrames() const {
+            return bufferSizeInFrames.load();
+        }
+
+        int32_t getBufferCapacityInFrames() const {
+            return bufferCapacityInFrames;
+        }
+
+        AudioApi getAudioApi() const {
+            return audioApi;
+        }
+
+        InputPreset getInputPreset() const {
+            return inputPreset;
+        }
+
+        int32_t getBytesPerSample() const;
+
+        int32_t getBytesPerFrame() const {
+            return getBytesPerSample() * channelCount;
+        }
+    };
+
+    /**
+     * @brief Controls the simulated device, these don't exist in Oboe.
+     */
+    namespace sim {
+        /**
+         * @brief The behavior of the simulated device, changes to the format apply to streams opened afterwards while faults apply immediately.
+         */
+        struct DeviceConfig {
+            int32_t sampleRate{48000}; //!< The rate that streams are opened with if none is requested.
+            int32_t framesPerBurst{192}; //!< The amount of frames consumed or produced by the device at once, this is 4ms at 48kHz.
+            int32_t capacityBursts{8}; //!< The capacity of streams in bursts if none is requested.
+
+            // Faults that are injected to exercise the handling of a misbehaving device, probabilities range from 0 to 1.
+            int64_t transitionDelayNanoseconds{}; //!< The maximum random delay before a requested transition settles, on top of waiting for the next burst.
+            double failureRate{}; //!< The probability of a request for a transition failing with ErrorInternal without any effect.
+            double stallRate{}; //!< The probability of the device stalling before a burst, data callbacks and transitions are held back while it's stalled.
+            int64_t stallNanoseconds{50 * kNanosPerMillisecond}; //!< The duration of a stall.
+            double lostWakeupRate{}; //!< The probability of a state change not waking up the threads waiting for it, they only notice it on the next state change or their timeout.
+        };
+
+        void SetDeviceConfig(const DeviceConfig& config);
+
+        DeviceConfig GetDeviceConfig();
+
+        /**
+         * @brief Counters of the simulated device across all streams, these are cumulative from the start of the process.
+         */
+        struct Statistics {
+            uint64_t waits; //!< The amount of calls to waitForStateChange.
+            uint64_t timedOutWaits; //!< The amount of calls to waitForStateChange that timed out.
+            int64_t longestWaitNanoseconds; //!< The duration of the longest completed call to waitForStateChange.
+            uint32_t activeWaits; //!< The amount of calls to waitForStateChange that are currently waiting.
+            int64_t oldestActiveWaitNanoseconds; //!< How long the oldest call to waitForStateChange that's still waiting has been waiting, 0 if there are none.
+            uint64_t injectedFailures;
+            uint64_t injectedStalls;
+            uint64_t lostWakeups;
+        };
+
+        Statistics GetStatistics();
+    }
+}